@@ -0,0 +1,49 @@
+// Measures how fast the lexer gets through a file, without parsing or running anything.
+// Built by `make lexbench`, and run as `./lib/lexbench [filename] [seconds]`.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "lexer.h"
+
+int main(const int argc, char ** argv) {
+    const std::filesystem::path path = argc > 1 ? argv[1] : "./samples/test.spl";
+    const double seconds = argc > 2 ? std::stod(argv[2]) : 1.0;
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "could not open " << path << std::endl;
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const auto source = buffer.str();
+
+    using clock = std::chrono::steady_clock;
+    size_t tokens = 0;
+    size_t passes = 0;
+    const auto start = clock::now();
+    const auto deadline = start + std::chrono::duration<double>(seconds);
+    try {
+        do {
+            lexer::Lexer lexer(source, path);
+            lexer::Token token;
+            while (lexer.advanceToken(token))
+                tokens++;
+            passes++;
+        } while (clock::now() < deadline);
+    } catch (const exceptions::SyntaxError & err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    const std::chrono::duration<double> elapsed = clock::now() - start;
+
+    const auto bytes = (double) source.size() * passes;
+    std::cout << path.string() << ": " << source.size() << " bytes, " << tokens / passes << " tokens" << std::endl;
+    std::cout << passes << " passes in " << elapsed.count() << "s, "
+        << bytes / elapsed.count() / 1e6 << " MB/s, "
+        << tokens / elapsed.count() / 1e6 << " Mtokens/s" << std::endl;
+}
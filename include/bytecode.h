@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parsing.h"
+#include "value.h"
+
+namespace runtime {
+    struct Stackframe;
+    class SyntaxFunction;
+}
+
+/// Contains the bytecode compiler and the virtual machine that runs it.
+/// Function bodies are lowered into a flat instruction stream once, and then executed by a dispatch loop
+/// instead of walking the syntax tree.
+namespace bytecode {
+    /// Every operation the virtual machine can execute, along with what it does to the stack.
+    /// This is an X-macro so that the enum, the mnemonics and the dispatch table can't fall out of sync.
+#define BYTECODE_OPCODES(X) \
+    X(PUSH_CONST) /* push constants[a] */ \
+    X(PUSH_COPY) /* push a fresh copy of the list or map in constants[a] */ \
+    X(PUSH_NULL) /* push null */ \
+    X(POP) /* discard the top of the stack */ \
+    X(LOAD_LOCAL) /* push locals[a] */ \
+    X(STORE_LOCAL) /* pop into locals[a] */ \
+    X(LOAD_GLOBAL) /* push the variable named by paths[a] */ \
+    X(STORE_GLOBAL) /* pop into the variable named by paths[a] */ \
+    X(INDEX) /* pop index, container; push container[index] */ \
+    X(TRY_INDEX) /* pop index, container; push container[index], or null if it isn't there */ \
+    X(STORE_INDEX) /* pop value, index, container; container[index] = value, or raise constants[a] */ \
+    X(ADD) X(SUB) X(MULT) X(DIV) X(MOD) \
+    X(EQ) X(NEQ) X(LT) X(GT) X(LEQ) X(GEQ) \
+    X(BIT_AND) X(BIT_OR) X(XOR) X(SHL) X(SHR) \
+    /* the operators above rewrite themselves into these once they see two integers or two numbers */ \
+    X(ADD_INT) X(SUB_INT) X(MULT_INT) X(DIV_INT) X(MOD_INT) \
+    X(EQ_INT) X(NEQ_INT) X(LT_INT) X(GT_INT) X(LEQ_INT) X(GEQ_INT) \
+    X(ADD_NUM) X(SUB_NUM) X(MULT_NUM) X(DIV_NUM) X(MOD_NUM) \
+    X(EQ_NUM) X(NEQ_NUM) X(LT_NUM) X(GT_NUM) X(LEQ_NUM) X(GEQ_NUM) \
+    X(NOT) /* replace the top of the stack with its boolean inverse */ \
+    X(TO_BOOL) /* replace the top of the stack with its truthiness */ \
+    X(JUMP) /* jump to a */ \
+    X(JUMP_IF_FALSE) /* pop a value, jump to a if it is falsy */ \
+    X(JUMP_IF_FALSE_OR_POP) /* if the top of the stack is falsy, replace it with false and jump to a, otherwise pop it */ \
+    X(JUMP_IF_TRUE_OR_POP) /* if the top of the stack is truthy, replace it with true and jump to a, otherwise pop it */ \
+    X(CALL) /* pop b arguments, call the function named by paths[a], push the result */ \
+    X(TAIL_CALL) /* pop b arguments, return them to be called with the function named by paths[a] in place of this one */ \
+    X(MAKE_LIST) /* pop a values, push them as a list */ \
+    X(MAKE_MAP) /* pop one value per key in keyLists[a], push them as a map */ \
+    X(TRY_BEGIN) /* install an error handler at a */ \
+    X(TRY_END) /* remove the innermost error handler */ \
+    X(RETURN) /* pop a value and return it */ \
+    X(THROW) /* raise a runtime error with the message in constants[a] */
+
+    enum struct Opcode : uint8_t {
+#define X(name) name,
+        BYTECODE_OPCODES(X)
+#undef X
+    };
+
+    /// @brief Returns the mnemonic of an opcode.
+    std::string to_string(Opcode op);
+
+    /// A single instruction. Operands are indices into the owning chunk's tables.
+    struct Instruction {
+        Opcode op;
+        uint32_t a = 0;
+        uint32_t b = 0;
+    };
+
+    /// A compiled function body.
+    struct Chunk {
+        std::vector<Instruction> code {};
+        /// The source position each instruction was compiled from, used for error reporting.
+        std::vector<exceptions::FilePosition> positions {};
+        std::vector<value::Value> constants {};
+        /// The paths calls resolve are at the position of the call, rather than of the path.
+        std::vector<parsing::Path> paths {};
+        std::vector<std::vector<intern::Symbol>> keyLists {};
+
+        /// @brief Returns a human-readable listing of the chunk.
+        std::string to_string() const;
+    };
+
+    /// @brief Lowers a resolved function's body into a chunk.
+    std::shared_ptr<Chunk> compile(const runtime::SyntaxFunction & function);
+
+    /// @brief Calls a function on the virtual machine, compiling it first if it hasn't been yet.
+    /// Calls it makes to other syntax functions run in the same dispatch loop, with their frames on a heap stack
+    /// instead of the native one, so recursion is only limited by `runtime::maxCallDepth`.
+    /// Arithmetic instructions are quickened in place as they run, so chunks are changed by running them.
+    /// @param caller The frame making the call.
+    /// @param args The arguments, which are moved out of.
+    /// @throw exceptions::RuntimeError
+    value::Value execute(runtime::SyntaxFunction & function, runtime::Stackframe & caller, std::vector<value::Value> & args);
+}
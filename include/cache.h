@@ -0,0 +1,33 @@
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+
+#include "parsing.h"
+
+/// A cache of parsed modules on disk, so unchanged files don't need to be lexed and parsed again on every run.
+///
+/// Each source file gets one cache file, named after a hash of its canonical path. The cache file starts with a
+/// header recording the format version, the source's modification time, size and content hash, and the path itself;
+/// if any of these don't match, the entry is ignored and overwritten. The rest of the file is the syntax tree,
+/// serialized depth-first.
+namespace cache {
+    /// Whether the cache is used at all. Turned off by `--no-cache`.
+    extern bool enabled;
+
+    /// @brief Returns the directory cache files are kept in.
+    /// This is `$SHRIMPLY_CACHE_DIR` if it's set, then `$XDG_CACHE_HOME/shrimply`, then `~/.cache/shrimply`.
+    /// @return Whether there is anywhere to keep them.
+    bool directory(std::filesystem::path & out);
+
+    /// @brief Loads the syntax tree cached for a source file, if there is one and it's still current.
+    /// @param path The canonical path of the source file.
+    /// @param source The contents of the source file.
+    /// @return Whether the tree was loaded.
+    bool load(const std::filesystem::path & path, std::string_view source, parsing::Root & out);
+
+    /// @brief Writes the syntax tree of a source file to the cache. Failing to do so is silently ignored.
+    /// @param path The canonical path of the source file.
+    /// @param source The contents of the source file.
+    void store(const std::filesystem::path & path, std::string_view source, const parsing::Root & root);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+namespace parsing {
+    struct Path;
+}
+
+namespace runtime {
+    class AbstractFunction;
+    struct Stackframe;
+}
+
+/// Exact counts of the work a script does, turned on by `--count`.
+///
+/// Unlike timings, these come out the same on every run of the same script, so they can be compared between runs on
+/// noisy machines. Everything is counted against the function that was running when it happened, including whatever
+/// the natives it called did. Which counts go up depends on what runs the script: the virtual machine counts
+/// instructions, and the tree-walker counts statements and expressions instead.
+namespace counters {
+    struct Counts {
+        /// How many times the function was called, tail calls included.
+        uint64_t calls = 0;
+        uint64_t statements = 0;
+        uint64_t expressions = 0;
+        uint64_t instructions = 0;
+        /// Strings, lists and maps copied into another value, which shares them rather than copying them itself.
+        /// Copies of anything else are as cheap as moving it, and aren't counted.
+        uint64_t copies = 0;
+        /// Strings, lists and maps allocated on the heap.
+        uint64_t allocations = 0;
+    };
+
+    /// Whether anything is being counted. Only ever set before the script starts running.
+    extern bool enabled;
+
+    /// The counts of the function that's running.
+    extern Counts * current;
+
+    /// @brief Adds one to a count of the function that's running. Only called through count.
+    /// It's kept out of line so that the check in count is all that gets inlined into the hot paths it's in; any more
+    /// and the compiler stops inlining things like value destructors into the virtual machine to make up for it.
+    [[gnu::cold, gnu::noinline]] void increment(uint64_t Counts::* counter);
+
+    /// @brief Adds one to a count of the function that's running, if counting is turned on.
+    inline void count(uint64_t Counts::* counter) {
+        if (enabled) [[unlikely]] increment(counter);
+    }
+
+    /// @brief Starts counting, against the root frame until the first call.
+    void start(const runtime::Stackframe & root);
+
+    /// @brief Counts a call, and counts everything after it against the function the frame is now running.
+    void call(const runtime::Stackframe & frame);
+
+    /// @brief Counts everything from now on against the function a frame is running, like when a call returns to it.
+    void resume(const runtime::Stackframe & frame);
+
+    /// @brief Counts a call to a native function. Calls to syntax functions are counted by call instead.
+    void native(runtime::AbstractFunction & function, const parsing::Path & path);
+
+    /// Goes back to counting against whatever function was running when this was made, once it goes away.
+    class Scope {
+        Counts * previous = current;
+    public:
+        Scope() = default;
+        ~Scope() { current = previous; }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+    };
+
+    /// @brief Prints the counts of every function that ran, and how many times each native was called.
+    void print(std::ostream & stream);
+}
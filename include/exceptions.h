@@ -3,20 +3,21 @@
 #include <exception>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
+
+#include "intern.h"
 
 namespace runtime {
     struct Stackframe;
+    struct Module;
 }
 
 namespace lexer {
     class TokenType;
 }
 
-namespace parsing {
-    enum struct ParserState;
-}
-
 namespace exceptions {
     struct FilePosition {
         size_t line = 1;
@@ -48,8 +49,8 @@ namespace exceptions {
             return {"unexpected end of file", position, std::move(filename)};
         }
 
-        static SyntaxError unexpectedToken(const lexer::Token &token, parsing::ParserState state, std::filesystem::path filename);
-        static SyntaxError unexpectedToken(const lexer::Token &token, parsing::ParserState state, lexer::TokenType expected, std::filesystem::path filename);
+        static SyntaxError unexpectedToken(const lexer::Token &token, std::filesystem::path filename);
+        static SyntaxError unexpectedToken(const lexer::Token &token, lexer::TokenType expected, std::filesystem::path filename);
 
         static SyntaxError invalidToken(const lexer::Token &token, const std::string &why, std::filesystem::path filename);
 
@@ -59,11 +60,22 @@ namespace exceptions {
     };
 
     class RuntimeError: public std::exception {
-        std::string formatted;
+        /// One line of the backtrace.
+        struct Record {
+            FilePosition position;
+            std::string_view function;
+            /// The module's name rather than the module, since modules can be gone by the time this is formatted.
+            intern::Symbol module;
+        };
+
+        /// Captured eagerly, since the frames are gone once the error unwinds,
+        /// but only formatted if something asks for it. Most errors are caught by a recover block that never does.
+        std::vector<Record> backtrace;
+        mutable std::string formatted;
     public:
         std::string message;
         explicit RuntimeError(const runtime::Stackframe & frame, std::string msg);
 
-        const char * what() const noexcept override { return formatted.c_str(); }
+        const char * what() const noexcept override;
     };
 }
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/// Interned strings, shared between the parser and the runtime.
+/// Every distinct string is stored exactly once, so two symbols are equal exactly when they point at the same string,
+/// and hashing one is hashing a pointer.
+namespace intern {
+    /// A string in the table.
+    struct Entry {
+        std::string string;
+        /// How many symbols refer to this, or zero if it stays in the table for the whole run.
+        size_t refs;
+    };
+
+    class Symbol final {
+        Entry * entry;
+        static Entry * empty();
+        /// @brief Takes a key nothing refers to anymore out of the table.
+        static void release(Entry * entry);
+
+        void retain() const { if (entry->refs) entry->refs++; }
+        void drop() { if (entry->refs && --entry->refs == 0) release(entry); }
+    public:
+        /// The empty string.
+        Symbol() : entry(empty()) {}
+        /// Interns a string for the rest of the run, which is what the parser does with identifiers and literal keys.
+        Symbol(std::string_view string);
+        Symbol(const std::string & string) : Symbol(std::string_view(string)) {}
+        Symbol(const char * string) : Symbol(std::string_view(string)) {}
+
+        Symbol(const Symbol & other) : entry(other.entry) { retain(); }
+        Symbol(Symbol && other) noexcept : entry(other.entry) { other.entry = empty(); }
+        Symbol & operator=(const Symbol & other) {
+            other.retain();
+            drop();
+            entry = other.entry;
+            return *this;
+        }
+        Symbol & operator=(Symbol && other) noexcept {
+            std::swap(entry, other.entry);
+            return *this;
+        }
+        ~Symbol() { drop(); }
+
+        /// @brief Gets the symbol for a map key made while a script runs.
+        /// Unless the string was already in the table, it only stays there for as long as a symbol refers to it,
+        /// so filling a map with unique keys doesn't grow the table for good.
+        static Symbol key(std::string_view string);
+
+        /// @brief Looks up a symbol without interning the string if it isn't there yet.
+        /// @return Whether the string is in the table, which is needed for it to be a key anywhere.
+        static bool find(std::string_view string, Symbol & out);
+
+        const std::string & str() const { return entry->string; }
+        const std::string * get() const { return &entry->string; }
+
+        bool operator==(const Symbol & other) const { return entry == other.entry; }
+        bool operator!=(const Symbol & other) const { return entry != other.entry; }
+    };
+
+    /// @brief Makes the table safe to use from other threads for as long as this is alive.
+    /// Only one thread uses the table otherwise, so it doesn't lock.
+    class Shared final {
+    public:
+        Shared();
+        ~Shared();
+        Shared(const Shared &) = delete;
+        Shared & operator=(const Shared &) = delete;
+    };
+
+    inline std::ostream & operator<<(std::ostream & stream, const Symbol & symbol) {
+        return stream << symbol.str();
+    }
+}
+
+template<>
+struct std::hash<intern::Symbol> {
+    size_t operator()(const intern::Symbol & symbol) const noexcept {
+        return std::hash<const std::string*>{}(symbol.get());
+    }
+};
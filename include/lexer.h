@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <filesystem>
 
 #include "exceptions.h"
@@ -49,6 +50,7 @@ namespace lexer {
             PUNC_DIV, // /
             PUNC_MOD, // %
             PUNC_INDEX, // .
+            PUNC_TRY_INDEX, // .?
             PUNC_COMMA, // ,
             PUNC_TERNARY, // ?
             PUNC_AND, // &&
@@ -110,16 +112,16 @@ namespace lexer {
         friend Lexer;
         friend parsing::Parser;
 
-        std::string * parent;
+        const char * source;
         size_t start;
         size_t end;
         exceptions::FilePosition position { 1, 1 };
         TokenType type;
     public:
-        Token() : parent(nullptr), start(0), end(0), type() {}
+        Token() : source(nullptr), start(0), end(0), type() {}
 
-        Token(std::string * p, const size_t s, const size_t e, const TokenType t)
-            : parent(p), start(s), end(e), type(t)
+        Token(const char * source, const size_t s, const size_t e, const TokenType t)
+            : source(source), start(s), end(e), type(t)
         {}
         /// @brief Returns the file position of the token.
         exceptions::FilePosition getPosition() const { return position; };
@@ -129,37 +131,46 @@ namespace lexer {
         size_t getStart() const { return start; }
         /// @brief Returns the end index of the token.
         size_t getEnd() const { return end; }
-        /// @brief Returns the substring of the parent string that the token spans over.
-        std::string span() const;
+        /// @brief Returns the part of the source that the token spans over.
+        /// This points into the source instead of copying it, so it's only valid for as long as the source is.
+        std::string_view span() const {
+            return source ? std::string_view(source + start, end - start) : std::string_view();
+        }
         /// @brief Returns a formatted display of the token.
         std::string display() const;
     };
 
+    /// Splits source code into tokens. Tokens point into the source, so lexing never copies or allocates.
     class Lexer {
-        std::string & rawData;
-        // We store the data length so we don't have to keep computing it
-        const size_t dataLength;
+        std::string_view data;
         size_t index = 0;
-        exceptions::FilePosition position { 1, 1 };
+        /// The line the lexer is on, and the index it starts at.
+        size_t line = 1;
+        size_t lineStart = 0;
+
+        exceptions::FilePosition position() const { return { line, index - lineStart + 1 }; }
 
-        /// @brief Matches a string in the raw data, advancing if it is found.
-        /// @param needle The string to match.
-        /// @param token A token to write to. This is left untouched if the function returns false.
-        /// @return Whether the string was found.
-        bool chompString(const std::string& needle, Token & token);
+        /// @brief Moves the lexer forward, keeping track of any lines it passes.
+        void advanceTo(size_t to);
 
-        void incrementPosition();
+        /// @brief Scans the rest of an identifier or keyword, whose first character has already been checked.
+        void identifier(Token & token);
+
+        /// @brief Scans a number, whose first digit the lexer is on.
+        void number(Token & token);
 
     public:
         std::filesystem::path filename;
-        Lexer(std::string &data, std::filesystem::path filename);
+
+        /// @throw std::invalid_argument If the data isn't pure ASCII.
+        Lexer(std::string_view data, std::filesystem::path filename);
 
         /// @brief Skips over whitespace in the data string.
         void skipWhitespace();
 
         /// @brief Returns whether the lexer is at the end of the string.
         bool atEnd() const {
-            return index >= dataLength;
+            return index >= data.size();
         }
 
         /// @brief Advances the lexer by one token.
@@ -170,4 +181,3 @@ namespace lexer {
     };
 
 }
-
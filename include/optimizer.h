@@ -0,0 +1,18 @@
+#pragma once
+
+#include "parsing.h"
+
+/// Rewrites freshly parsed syntax trees so that less work is left for every time they run.
+///
+/// Operators whose operands are all literals are evaluated once and replaced with their result, ternaries with a
+/// literal predicate are replaced with the arm they'd take, and list and map literals whose members are all constant
+/// are built once into a template. Lists and maps are shared by reference, so evaluating a template hands out a fresh
+/// copy of it; nothing a script does to the result can reach the template itself.
+/// Anything that would raise an error is left alone, so that it still raises at the same point it used to.
+namespace optimizer {
+    /// Whether trees are optimized at all. Turned off by `--no-fold`.
+    extern bool enabled;
+
+    /// @brief Folds the constant expressions of every item in a file.
+    void fold(parsing::Root & root);
+}
@@ -1,41 +1,51 @@
 #pragma once
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "counters.h"
 #include "value.h"
 #include "lexer.h"
 
 namespace runtime {
     struct Stackframe;
+    class AbstractFunction;
 }
 
 namespace parsing {
-    /// The parser's current state.
-    enum struct ParserState {
-        ROOT, DECLARATION_IDENT, FUNCTION_IDENT, FUNCTION_OPEN_PAREN, ARGLIST_NEXT, BLOCK, ARGLIST_COMMA,
-        STATEMENT, BLOCK_START, DECLARATION_ASSIGN_OR_END,
-        EXPRESSION, STATEMENT_SEMICOLON, RETURN_EXPRESSION_OR_END, IF_PREDICATE,
-        BINARY_LHS, BINARY_RHS, CALL_PATH, UNARY_VALUE, RETURN_END, LIST_NEXT, MAP_KEY,
-        CALL_ARGS_NEXT, CALL_L_PAREN, CALL_ARG_EXPR, CALL_ARGS_COMMA,
-        IF_TRUE, IF_FALSE, IF_ELSE,
-        LIST_COMMA, LIST_EXPR,
-        MAP_KEY_STRING, MAP_EQ, MAP_VALUE, MAP_COMMA,
-        STATEMENT_EXPRESSION,
-        DECLARATION_END,
-        BLOCK_STATEMENT, GLOBAL_DECLARATION,
-        FUNCTION_STATEMENT, LOOP_STATEMENT,
-        PATH_IDENT,
-        PATH_SCOPE_OR_END,
-        USE_PATH,
-        TRY_STATEMENT,
-        TRY_MAYBE_RECV,
-        RECV_STATEMENT,
-        RECV_PATH,
-        TERNARY_PREDICATE,
-        TERNARY_LHS,
-        TERNARY_RHS,
+    /// Owns every node of a syntax tree. Nodes are bump-allocated out of large blocks instead of one at a time, so
+    /// building a tree is cheap, nodes parsed together sit together in memory, and the whole tree is freed at once.
+    /// Nodes point at their children with plain pointers, which are valid for as long as the arena is.
+    class Arena {
+        static constexpr size_t BLOCK_SIZE = 1 << 14;
+
+        /// A constructed node, and how to destroy it.
+        struct Node {
+            void * pointer;
+            void (*destroy)(void *);
+        };
+
+        std::vector<std::unique_ptr<std::byte[]>> blocks {};
+        size_t used = BLOCK_SIZE;
+        std::vector<Node> nodes {};
+
+        void * allocate(size_t size, size_t align);
+    public:
+        Arena() = default;
+        Arena(const Arena &) = delete;
+        Arena & operator=(const Arena &) = delete;
+        ~Arena();
+
+        /// @brief Constructs a node in the arena.
+        template<typename T, typename... Args>
+        T * make(Args&&... args) {
+            const auto node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            nodes.push_back({ node, [](void * pointer) { static_cast<T *>(pointer)->~T(); } });
+            return node;
+        }
     };
 
     class Atom {
@@ -50,7 +60,9 @@ namespace parsing {
     class Item: public Atom {};
     // The entire file.
     struct Root final: Atom {
-        std::vector<std::shared_ptr<Item>> items {};
+        /// Owns every node in the tree. Copies of the root share it.
+        std::shared_ptr<Arena> arena = std::make_shared<Arena>();
+        std::vector<Item *> items {};
         std::string to_string() const override {
             std::stringstream str;
             for (const auto& item : items) {
@@ -63,7 +75,7 @@ namespace parsing {
     class Statement: public Atom {};
     /// A syntactic block of statements.
     struct Block final: Statement {
-        std::vector<std::shared_ptr<Statement>> statements {};
+        std::vector<Statement *> statements {};
 
         std::string to_string() const override {
             std::stringstream ss;
@@ -75,25 +87,47 @@ namespace parsing {
         }
     };
     struct Expression: Atom {
-        /// Assigns a value to the place this expression represents.
+        /// Returns the storage for the place this expression represents.
         virtual value::Value *pointer(runtime::Stackframe &frame) {
             throw exceptions::RuntimeError(frame, "expression does not support assignment: " + to_string());
         }
+        /// Evaluates another expression and assigns it to the place this expression represents.
+        /// Places that aren't plain storage, like indexes, override this to evaluate their own parts exactly once.
+        virtual void assign(runtime::Stackframe &frame, Expression &value);
         /// Evaluates the rvalue and returns a result.
         virtual value::Value result(runtime::Stackframe & frame) {
             throw exceptions::RuntimeError(frame, "internal error: cannot evaluate expression: " + to_string());
         }
     };
+    /// What an identifier path was bound to by the resolver.
+    enum struct Binding {
+        /// Not inside of a function body, so it gets looked up by name.
+        UNRESOLVED,
+        /// A slot in the enclosing function's locals.
+        LOCAL,
+        /// A module global, looked up by name once and cached.
+        GLOBAL
+    };
+
     /// An identifier path.
     struct Path final: Expression {
-        std::vector<std::string> members;
+        std::vector<intern::Symbol> members;
+        Binding binding = Binding::UNRESOLVED;
+        /// The local slot, if this is bound to a local.
+        uint32_t slot = 0;
+        /// The global this names, once it's been found. Globals never move once declared.
+        mutable value::Value * global = nullptr;
+        /// The function this names when it's called, once it's been found.
+        mutable runtime::AbstractFunction * function = nullptr;
+        /// The value of Module::callEpoch when the function was found. The cache is stale if they differ.
+        mutable uint64_t functionEpoch = 0;
 
         std::string to_string() const override {
             if (members.empty()) return "<empty path>";
 
             std::stringstream ss;
 
-            for (int i = 0; i < members.size(); i++) {
+            for (size_t i = 0; i < members.size(); i++) {
                 if (i) ss << "::";
                 ss << members[i];
             }
@@ -103,7 +137,7 @@ namespace parsing {
         value::Value *pointer(runtime::Stackframe &frame) override;
         value::Value result(runtime::Stackframe & frame) override;
 
-        explicit Path(std::vector<std::string> path = {}) : members(std::move(path)) {}
+        explicit Path(std::vector<intern::Symbol> path = {}) : members(std::move(path)) {}
     };
     /// Importing a module.
     struct Use: Item {
@@ -115,7 +149,7 @@ namespace parsing {
     };
     /// An expression as a statement.
     struct ExpressionStatement final: Statement {
-        std::shared_ptr<Expression> expr;
+        Expression * expr = nullptr;
 
         std::string to_string() const override { return (expr ? expr->to_string() : "<nullptr>") + ";"; }
     };
@@ -123,6 +157,7 @@ namespace parsing {
     struct Literal final: Expression {
         value::Value value;
         value::Value result(runtime::Stackframe & frame) override {
+            counters::count(&counters::Counts::expressions);
             return value;
         };
         Literal() = default;
@@ -131,15 +166,15 @@ namespace parsing {
             return value.raw_string();
         }
 
-        explicit Literal(const value::Value &v) : value(v) {};
+        explicit Literal(value::Value v) : value(std::move(v)) {};
     };
     /// A binary expression.
     struct BinaryOp final: Expression {
         lexer::TokenType opr;
-        std::shared_ptr<Expression> lhs = std::make_shared<Literal>();
-        std::shared_ptr<Expression> rhs = std::make_shared<Literal>();
+        Expression * lhs = nullptr;
+        Expression * rhs = nullptr;
 
-        value::Value *pointer(runtime::Stackframe &frame) override;
+        void assign(runtime::Stackframe &frame, Expression &value) override;
         value::Value result(runtime::Stackframe & frame) override;
 
         explicit BinaryOp(lexer::TokenType _opr): opr(_opr) {}
@@ -150,7 +185,7 @@ namespace parsing {
     /// A unary expression.
     struct UnaryOp final: Expression {
         lexer::TokenType opr;
-        std::shared_ptr<Expression> value = std::make_shared<Literal>();
+        Expression * value = nullptr;
 
         value::Value result(runtime::Stackframe & frame) override;
 
@@ -162,11 +197,11 @@ namespace parsing {
     };
     /// A ternary expression.
     struct Ternary final: Expression {
-        std::shared_ptr<Expression> predicate = std::make_shared<Literal>();
-        std::shared_ptr<Expression> lhs = std::make_shared<Literal>();
-        std::shared_ptr<Expression> rhs = std::make_shared<Literal>();
+        Expression * predicate = nullptr;
+        Expression * lhs = nullptr;
+        Expression * rhs = nullptr;
 
-        value::Value *pointer(runtime::Stackframe &frame) override;
+        void assign(runtime::Stackframe &frame, Expression &value) override;
         value::Value result(runtime::Stackframe & frame) override;
 
         std::string to_string() const override {
@@ -176,7 +211,7 @@ namespace parsing {
     /// A function call.
     struct Call final: Expression {
         Path functionPath;
-        std::vector<std::shared_ptr<Expression>> arguments {};
+        std::vector<Expression *> arguments {};
         value::Value result(runtime::Stackframe & frame) override;
 
         std::string to_string() const override {
@@ -203,11 +238,10 @@ namespace parsing {
     };
     /// Returning a value from a function.
     struct Return final: Statement {
-        std::shared_ptr<Expression> value = std::make_shared<Literal>();
-        Return() {
-            value = std::make_shared<Literal>();
-        }
-
+        Expression * value = nullptr;
+        /// Whether the value is a call that can run in place of the current one, filled in by the resolver.
+        /// That's any returned call outside a try block, since a try block has to stay around to catch its errors.
+        bool tailCall = false;
         std::string to_string() const override {
             return "return " + value->to_string();
         }
@@ -215,25 +249,23 @@ namespace parsing {
     /// A declaration of a variable to a value;
     class Declaration final: public Statement, public Item {
     public:
-        std::string name;
-        std::shared_ptr<Expression> value = std::make_shared<Literal>();;
-        Declaration() {
-            value = std::make_shared<Literal>();
-        }
-
+        intern::Symbol name;
+        /// The local slot the resolver assigned to this declaration.
+        uint32_t slot = 0;
+        Expression * value = nullptr;
         std::string to_string() const override {
-            return ":= " + name + " " + value->to_string();
+            return ":= " + name.str() + " " + value->to_string();
         }
     };
     /// A top level declaration of a function.
     struct Function final: Item {
-        std::string name;
-        std::vector<std::string> arguments {};
-        std::shared_ptr<Statement> body;
+        intern::Symbol name;
+        std::vector<intern::Symbol> arguments {};
+        Statement * body = nullptr;
 
         std::string to_string() const override {
             std::ostringstream ss;
-            ss << "fn " + name + "(";
+            ss << "fn " + name.str() + "(";
             for (const auto& arg : arguments) {
                 ss << arg << ", ";
             }
@@ -243,9 +275,9 @@ namespace parsing {
     };
     /// Alternation based on a predicate.
     struct IfElse final: Statement {
-        std::shared_ptr<Expression> predicate = std::make_shared<Literal>();
-        std::shared_ptr<Statement> truePath;
-        std::shared_ptr<Statement> falsePath;
+        Expression * predicate = nullptr;
+        Statement * truePath = nullptr;
+        Statement * falsePath = nullptr;
 
         std::string to_string() const override {
             std::ostringstream ss;
@@ -257,9 +289,9 @@ namespace parsing {
     };
     /// Error handling.
     struct TryRecover final: Statement {
-        std::shared_ptr<Statement> happyPath;
+        Statement * happyPath = nullptr;
         Path binding;
-        std::shared_ptr<Statement> sadPath;
+        Statement * sadPath = nullptr;
 
         std::string to_string() const override {
             std::ostringstream ss;
@@ -272,14 +304,17 @@ namespace parsing {
     };
     /// Repeated code execution.
     struct Loop final: Statement {
-        std::shared_ptr<Statement> body;
+        Statement * body = nullptr;
         std::string to_string() const override {
             return "loop " + (body ? body->to_string() : "<nullptr>");
         }
     };
 
     struct List final: Expression {
-        std::vector<std::shared_ptr<Expression>> members;
+        std::vector<Expression *> members;
+        /// If every member is constant, the list they make, filled in by the optimizer.
+        /// Evaluating the literal then copies this instead of evaluating the members.
+        value::Value constant;
         value::Value result(runtime::Stackframe & frame) override;
 
         std::string to_string() const override {
@@ -294,44 +329,74 @@ namespace parsing {
     };
 
     class Map final: public Expression {
-        friend Parser;
-        std::string nextKey;
     public:
-        std::unordered_map<std::string, std::shared_ptr<Expression>> pairs;
+        std::unordered_map<intern::Symbol, Expression *> pairs;
+        /// If every value is constant, the map they make, filled in by the optimizer.
+        /// Evaluating the literal then copies this instead of evaluating the values.
+        value::Value constant;
         value::Value result(runtime::Stackframe & frame) override;
 
         std::string to_string() const override {
             std::ostringstream ss;
             ss << "(";
             for (const auto& pair : pairs)
-                ss << value::escapeString(pair.first) << " = " << pair.second->to_string() << ", ";
+                ss << value::escapeString(pair.first.str()) << " = " << pair.second->to_string() << ", ";
             ss << ")";
             return ss.str();
         }
     };
 
 
+    /// Builds a syntax tree out of a file by recursive descent.
+    /// Every construct starts with a token that tells it apart, so the parser only ever needs to look one token
+    /// ahead, and pulls tokens from the lexer as it goes instead of lexing the whole file up front.
     class Parser {
+        lexer::Lexer & lexer;
+        /// The next token, which hasn't been consumed yet. Comments are skipped before they get here.
+        lexer::Token token;
+        Root root;
+        /// How many statements and expressions the parser is currently inside of.
+        size_t depth = 0;
+
+        class Level;
+
+        /// @brief Moves on to the next token that isn't a comment.
+        void advance();
+
+        /// @brief Consumes a token of a given type.
+        /// @throw exceptions::SyntaxError If the next token is of any other type.
+        void expect(lexer::TokenType::Value type);
+
+        /// @brief Consumes an identifier, returning its name.
+        intern::Symbol identifier();
+
+        /// @brief Gives a node the position of the token after it, which is the next token once it's been parsed.
+        /// That's where the state machine this parser replaced used to leave them, and errors at runtime are reported
+        /// from there, so it's kept that way.
+        template<typename T>
+        T * finish(T * node) {
+            node->position = token.getPosition();
+            return node;
+        }
+
+        Use * use();
+        /// A declaration is both a statement and an item, with a position for each, so this leaves it to the caller
+        /// to finish it as whichever one it is.
+        Declaration * declaration();
+        Function * function();
+        void path(Path & out);
+        Statement * statement();
+        Expression * expression();
+        Expression * literal(value::Value value);
+
     public:
-        lexer::Token lastToken;
-        std::vector<ParserState> stateStack { ParserState::ROOT };
-        std::shared_ptr<Root> syntaxTree;
-        std::vector<std::shared_ptr<Atom>> treeCursor;
         std::filesystem::path filename;
 
-        Parser(std::filesystem::path filename) : filename(std::move(filename)) {
-            const auto root = std::make_shared<Root>();
-            syntaxTree = root;
-            treeCursor.push_back(root);
-        }
-
-        /// @brief Advances the parser by one token.
-        /// @param token The next token in the file.
-        void advance(lexer::Token token);
+        Parser(lexer::Lexer & lexer, std::filesystem::path filename) : lexer(lexer), filename(std::move(filename)) {}
 
-        /// @brief Attempts to build the AST from complete input.
-        /// @throw void Will throw if the AST is incomplete (i.e. more tokens are expected.)
-        Root getSyntaxTree();
+        /// @brief Parses the rest of the file.
+        /// @throw exceptions::SyntaxError
+        Root parse();
     };
 
 }
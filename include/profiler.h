@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace runtime {
+    struct Stackframe;
+}
+
+/// A sampling profiler for scripts, turned on by `--profile`.
+///
+/// A timer raises SIGPROF every time the process uses up another interval of CPU time, and the handler does nothing
+/// but count the tick. The virtual machine checks for ticks before every instruction, and the tree-walker before
+/// every statement, and records the chain of frames running at that point against however many went by. Time spent
+/// in a native function is put on whatever runs right after it returns, which is nearly always the same line.
+namespace profiler {
+    /// Whether samples are being taken. The virtual machine only checks for ticks when it's started with this set.
+    extern bool enabled;
+
+    /// Ticks that haven't been recorded yet. Only ever added to by the signal handler, and cleared by sample.
+    extern std::atomic<uint32_t> pending;
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "the signal handler can't take a lock");
+
+    /// @brief Returns whether a sample should be taken.
+    inline bool due() { return pending.load(std::memory_order_relaxed) != 0; }
+
+    /// @brief Starts the timer.
+    /// @param interval How much CPU time goes by between ticks.
+    /// @return Whether the timer could be set up.
+    bool start(std::chrono::microseconds interval);
+
+    /// @brief Stops the timer, keeping every sample taken so far.
+    void stop();
+
+    /// @brief Records the frames running right now against every pending tick.
+    /// @param frame The innermost frame, with its source position up to date.
+    void sample(const runtime::Stackframe & frame);
+
+    /// @brief Writes every sampled stack in the collapsed format flame graph tools read: one line per distinct stack,
+    /// outermost frame first, separated by semicolons and followed by how many ticks it was seen for.
+    void writeCollapsed(std::ostream & stream);
+
+    /// @brief Prints the self and total time of the functions and lines that took up the most of it.
+    /// @param rows How many of each to print at most.
+    void printSummary(std::ostream & stream, size_t rows);
+}
@@ -1,12 +1,66 @@
 #pragma once
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <filesystem>
 
 #include "parsing.h"
 #include "value.h"
 
+namespace bytecode {
+    struct Chunk;
+}
+
 namespace runtime {
+    struct Module;
+    class SyntaxFunction;
+
+    /// A call in tail position whose arguments have been evaluated, but which hasn't been made yet.
+    /// The tree-walker hands it back to SyntaxFunction::call, which runs the callee in the same frame instead
+    /// of nesting it, so tail calls don't grow the native stack or the frame chain.
+    struct TailCall {
+        SyntaxFunction * function = nullptr;
+        std::vector<value::Value> args {};
+    };
+
+    /// Whether function bodies are run by walking the syntax tree instead of being compiled to bytecode.
+    /// The tree-walker is kept around as a reference implementation to diff the virtual machine against.
+    extern bool useTreeWalker;
+
+    /// How deeply calls may nest before raising an error. Set by `--max-depth` or `SHRIMPLY_MAX_DEPTH`.
+    extern size_t maxCallDepth;
+
+    /// The local slots of every active call, kept as a stack so that calling a function doesn't allocate.
+    /// Storage is split into fixed segments, so slots never move while a call is using them.
+    class LocalStack {
+        static constexpr size_t SEGMENT_SIZE = 1 << 14;
+
+        std::vector<std::unique_ptr<value::Value[]>> segments {};
+        std::vector<size_t> segmentSizes {};
+        size_t segment = 0;
+        size_t top = 0;
+    public:
+        /// A position in the stack to return to.
+        struct Mark {
+            size_t segment;
+            size_t top;
+        };
+
+        /// @brief Reserves a run of null slots.
+        /// @param count The number of slots.
+        /// @param mark Out parameter to store the position to release back to.
+        value::Value * push(size_t count, Mark & mark);
+
+        /// @brief Nulls out and frees every slot reserved since a mark was taken.
+        void release(Mark mark);
+    };
+
+    /// The locals of every call that's running.
+    extern LocalStack localStack;
 
     class AbstractFunction {
     public:
@@ -14,43 +68,76 @@ namespace runtime {
         virtual value::Value call(Stackframe &frame, std::vector<value::Value> & args) {
             throw exceptions::RuntimeError(frame, "internal error: tried to call an abstract function");
         }
+
+        /// @brief Gets this as a syntax function, if it is one. Calls check this every time, so it's cheaper than
+        /// a dynamic_cast.
+        virtual SyntaxFunction * asSyntax() { return nullptr; }
     };
 
     class SyntaxFunction final: public AbstractFunction {
     public:
-        std::vector<std::string> argumentNames;
-        std::string name;
+        std::vector<intern::Symbol> argumentNames;
+        intern::Symbol name;
         exceptions::FilePosition pos;
-        std::vector<std::shared_ptr<parsing::Statement>> body;
+        /// Points into the syntax tree of the module, which keeps it alive.
+        std::vector<parsing::Statement *> body;
+        /// The local slots arguments are stored into, in order, filled in by the resolver.
+        std::vector<uint32_t> argumentSlots;
+        uint32_t argcSlot = 0;
+        uint32_t localCount = 0;
+        /// The module the function was declared in. This is what its globals and calls are resolved against.
+        Module * module = nullptr;
+        /// The compiled body, filled in on the first call.
+        std::shared_ptr<bytecode::Chunk> chunk;
 
         value::Value call(Stackframe & frame, std::vector<value::Value> & args) override;
+        SyntaxFunction * asSyntax() override { return this; }
+
+        /// @brief Points a fresh frame at this function, and moves the arguments into newly reserved locals.
+        /// @param mark Out parameter for where to release the locals back to once the call is over.
+        void enter(Stackframe & frame, value::Value * args, size_t count, LocalStack::Mark & mark);
     };
 
     struct Module {
-        std::string moduleName;
-        std::unordered_map<std::string, std::shared_ptr<Module>> imported;
-        std::unordered_map<std::string, value::Value> globals {};
-        std::unordered_map<std::string, std::shared_ptr<AbstractFunction>> functions;
+        intern::Symbol moduleName;
+        std::unordered_map<intern::Symbol, std::shared_ptr<Module>> imported;
+        std::unordered_map<intern::Symbol, value::Value> globals {};
+        std::unordered_map<intern::Symbol, std::shared_ptr<AbstractFunction>> functions;
+        /// The nodes of the module's syntax tree, which its functions run from.
+        std::shared_ptr<parsing::Arena> tree;
+
+        std::shared_ptr<AbstractFunction> getFunction(Stackframe &frame, const parsing::Path &path);
 
-        std::shared_ptr<AbstractFunction> getFunction(Stackframe &frame, parsing::Path &path);
+        /// Call sites cache the function they resolve to, which is only valid for as long as no module's functions
+        /// or imports change. Anything that changes them after loading must call invalidateCalls.
+        static uint64_t callEpoch;
+        static void invalidateCalls() { callEpoch++; }
+
+        /// @brief Finds the function a call site names, caching it on the path.
+        AbstractFunction & resolveCall(Stackframe &frame, const parsing::Path &path);
 
         explicit Module(bool isStdLib = false);
     };
 
+    /// A single function call. Blocks and loops don't get their own frames, since the resolver already gave their
+    /// locals slots, so this is only created once per call and is cheap to copy.
     struct Stackframe {
         Stackframe * parent;
-        std::shared_ptr<Module> root;
+        Module * root;
         size_t depth;
-        std::unordered_map<std::string, value::Value> variables {};
-        std::vector<std::shared_ptr<parsing::Statement>> body {};
+        /// The local slots of the function this frame belongs to.
+        value::Value * locals;
 
-        std::string functionName;
+        std::string_view functionName;
         exceptions::FilePosition sourcePos;
-        bool boundary = false;
 
+        /// @brief Finds the variable a path names.
+        /// @throw exceptions::RuntimeError
         value::Value * getVariable(const parsing::Path &path);
 
-        void assignVariable(const parsing::Path & path, const value::Value & value);
+        /// @brief Looks up a global by name, bypassing any local bindings.
+        /// @throw exceptions::RuntimeError
+        value::Value * getGlobal(const parsing::Path &path);
 
         Stackframe branch(exceptions::FilePosition pos);
     };
@@ -64,4 +151,51 @@ namespace runtime {
     );
 
     parsing::Root parseFile(std::filesystem::path &path);
+
+    /// How many threads imports are parsed on. Set by `--jobs`, and defaults to the number of cores.
+    extern size_t parseJobs;
+
+    /// @brief Finds every module a file imports, directly or not, and parses them all ahead of time on parseJobs
+    /// threads. initModule then takes each tree from here when it gets to the import, instead of parsing it there.
+    /// Nothing is raised from here. An import that fails to resolve or parse fails once initModule reaches it,
+    /// with the same error it would have had without this.
+    void parseImports(const std::filesystem::path &filepath, const parsing::Root &root);
+
+    /// Where the time before main runs goes. Printed by `--startup-profile`.
+    struct StartupProfile {
+        /// Added up over every thread that parsed something, so this can be more than the time that went by.
+        std::chrono::nanoseconds parsing {};
+        std::chrono::nanoseconds resolving {};
+        std::chrono::nanoseconds total {};
+        size_t filesParsed = 0;
+        size_t cacheHits = 0;
+        size_t modulesResolved = 0;
+        size_t resolutionHits = 0;
+        size_t directoriesListed = 0;
+
+        void print(std::ostream & stream) const;
+    };
+    extern StartupProfile startupProfile;
+
+    /// @brief Binds every local in a function body to a slot, and every other identifier to a global.
+    void resolve(SyntaxFunction & function);
+
+    /// @brief Applies an arithmetic, comparison or bitwise operator to two evaluated operands.
+    /// @throw exceptions::RuntimeError
+    value::Value binaryOperation(Stackframe &frame, lexer::TokenType::Value opr, const value::Value &left, const value::Value &right);
+
+    /// @brief Indexes into a string, list or map.
+    /// @throw exceptions::RuntimeError
+    value::Value indexValue(Stackframe &frame, const value::Value &container, const value::Value &index);
+
+    /// @brief Indexes into a string, list or map, without throwing if the index isn't there.
+    /// Does a single probe, so checking for a key and reading it is one lookup.
+    /// @return Whether the index was found.
+    /// @throw exceptions::RuntimeError If the container can't be indexed, or not with that type of index.
+    bool tryIndex(Stackframe &frame, const value::Value &container, const value::Value &index, value::Value &out);
+
+    /// @brief Assigns to an index of a list or map.
+    /// @return Whether the container supports index assignment.
+    /// @throw exceptions::RuntimeError
+    bool assignIndex(Stackframe &frame, const value::Value &container, const value::Value &index, const value::Value &value);
 }
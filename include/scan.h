@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/// Scans over runs of source text for the lexer, a block of bytes at a time where the platform allows it.
+///
+/// On x86-64, runs are scanned 16 bytes at a time with SSE2, and the scans that tend to cover long stretches
+/// (validation, comments, strings and counting lines) use 32 byte AVX2 blocks on processors that have it.
+/// Everything else, and anything built with `-DSHRIMPLY_NO_SIMD`, falls back to going one byte at a time.
+/// Every function takes the range to scan as a pair of pointers, and never reads outside of it.
+namespace scan {
+    enum CharClass : uint8_t {
+        SPACE = 1,
+        DIGIT = 2,
+        /// Characters an identifier can start with.
+        IDENT_START = 4,
+        /// Characters an identifier can continue with.
+        IDENT = 8
+    };
+
+    inline constexpr auto CLASSES = [] {
+        std::array<uint8_t, 256> classes {};
+        for (const char chr : std::string_view(" \t\n\v\f\r")) classes[(unsigned char) chr] |= SPACE;
+        for (int chr = '0'; chr <= '9'; chr++) classes[chr] |= DIGIT | IDENT;
+        for (int chr = 'a'; chr <= 'z'; chr++) classes[chr] |= IDENT_START | IDENT;
+        for (int chr = 'A'; chr <= 'Z'; chr++) classes[chr] |= IDENT_START | IDENT;
+        classes['_'] |= IDENT_START | IDENT;
+        return classes;
+    }();
+
+    /// @brief Returns whether a character is in a class.
+    inline bool is(const char chr, const CharClass cls) {
+        return CLASSES[(unsigned char) chr] & cls;
+    }
+
+    /// @brief Returns whether every byte in a range is ASCII.
+    bool isAscii(const char * begin, const char * end);
+
+    /// Runs up to this long are scanned one byte at a time, inline. Most tokens and most gaps between them are only a
+    /// few bytes long, and on those, setting up a block costs more than it saves.
+    constexpr ptrdiff_t SHORT_RUN = 16;
+
+    /// @brief Skips a run of whitespace, identifier characters or digits that's longer than a short run.
+    const char * skipLong(const char * begin, const char * end, CharClass cls);
+
+    /// @return The first character that isn't in a class, or the end.
+    inline const char * skip(const char * begin, const char * end, const CharClass cls) {
+        const auto shortEnd = end - begin > SHORT_RUN ? begin + SHORT_RUN : end;
+        for (auto cursor = begin; cursor < shortEnd; cursor++)
+            if (!is(*cursor, cls)) return cursor;
+        return shortEnd == end ? end : skipLong(shortEnd, end, cls);
+    }
+
+    /// @return Where the first `*/` starts, or the end if there isn't one.
+    const char * findCommentEnd(const char * begin, const char * end);
+
+    /// @return The first quote or backslash, or the end.
+    const char * findQuoteOrEscape(const char * begin, const char * end);
+
+    /// @brief Counts the newlines in a range that's longer than a short run.
+    size_t countNewlinesLong(const char * begin, const char * end, const char *& last);
+
+    /// @brief Counts the newlines in a range.
+    /// @param last Out parameter for the last newline found, left untouched if there aren't any.
+    inline size_t countNewlines(const char * begin, const char * end, const char *& last) {
+        if (end - begin > SHORT_RUN) return countNewlinesLong(begin, end, last);
+        size_t count = 0;
+        for (auto cursor = begin; cursor < end; cursor++) {
+            if (*cursor != '\n') continue;
+            count++;
+            last = cursor;
+        }
+        return count;
+    }
+}
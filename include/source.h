@@ -0,0 +1,38 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+/// Reads source files for the lexer.
+///
+/// Regular files are mapped read-only, so the lexer works straight over the file's pages and nothing is copied.
+/// Anything that can't be mapped, like a pipe or standard input, is read in chunks into a single buffer instead.
+/// Either way, the whole file is kept, NUL bytes included.
+namespace source {
+    /// The name that reads a script from standard input instead of from a file.
+    inline const std::filesystem::path STANDARD_INPUT = "-";
+
+    /// The contents of a source file, kept for as long as this is around.
+    class File {
+        void * mapping = nullptr;
+        size_t mappedSize = 0;
+        std::string buffer {};
+        std::string_view contents {};
+
+        /// @brief Reads everything left in a file descriptor into the buffer.
+        void readAll(int fd, size_t sizeHint);
+    public:
+        /// Whether the contents came from standard input.
+        bool fromStandardInput = false;
+
+        /// @brief Opens a source file, or standard input if the path is STANDARD_INPUT.
+        /// @throw std::runtime_error If the file couldn't be opened or read.
+        explicit File(const std::filesystem::path & path);
+        ~File();
+        File(const File &) = delete;
+        File & operator=(const File &) = delete;
+
+        std::string_view text() const { return contents; }
+    };
+}
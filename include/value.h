@@ -1,11 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <unordered_map>
 #include <memory>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "counters.h"
+#include "intern.h"
 #include "lexer.h"
 
 namespace parsing {
@@ -18,11 +20,57 @@ namespace value {
 
     struct Null {};
 
+    class Value;
+    using List = std::vector<Value>;
+    using Map = std::unordered_map<intern::Symbol, Value>;
+
+    /// The header of every heap-allocated payload, holding its reference count.
+    struct Object {
+        size_t refs = 1;
+    };
+
+    /// A reference counted payload living on the heap.
+    template<typename T>
+    struct Boxed final: Object {
+        T data;
+
+        template<typename... Args>
+        explicit Boxed(Args&&... args) : data(std::forward<Args>(args)...) {}
+    };
+
+    /// Strings are never changed in place, so they can remember their interned copy once they've been used as a key.
+    template<>
+    struct Boxed<std::string> final: Object {
+        std::string data;
+        mutable intern::Symbol symbol;
+        mutable bool interned = false;
+
+        explicit Boxed(std::string data) : data(std::move(data)) {}
+    };
+
+    /// A handle to a boxed payload. This doesn't own anything by itself, since Value does the reference counting;
+    /// that keeps it trivial enough to live in Value's union.
+    template<typename T>
+    class Ref {
+        Boxed<T> * box;
+    public:
+        Ref() = default;
+        explicit Ref(Boxed<T> * box) : box(box) {}
+
+        T * operator->() const { return &box->data; }
+        T & operator*() const { return box->data; }
+        T * get() const { return &box->data; }
+
+        bool operator==(const Ref & other) const { return box == other.box; }
+    };
+
+    /// A dynamically typed value. This is 16 bytes: an 8 byte payload and a tag.
+    /// Scalars are copied as-is, while strings, lists and maps are shared behind a reference count.
     class Value final {
         friend parsing::BinaryOp;
         friend parsing::UnaryOp;
     public:
-        enum struct ValueType {
+        enum struct ValueType : uint8_t {
             Null,
             Integer,
             Number,
@@ -32,7 +80,6 @@ namespace value {
             Map,
             Extern
         };
-        static unsigned long long counter;
 
         // Note: These were originally private, but I stopped caring.
         // Nobody else is working on this anyways.
@@ -40,45 +87,56 @@ namespace value {
             int64_t integer;
             double number;
             bool boolean;
-            std::string string;
-            std::shared_ptr<std::vector<Value>> list;
-            std::shared_ptr<std::unordered_map<std::string, Value>> map;
+            Ref<std::string> string;
+            Ref<value::List> list;
+            Ref<value::Map> map;
             void* external;
+            /// Whichever boxed payload this holds, if it holds one.
+            Object* object;
         };
         ValueType tag;
 
-        unsigned long long id;
-
-        void initFrom(const Value& source) {
-            tag = source.tag;
-            id = source.id;
-            switch (source.tag) {
-                case ValueType::Null: break;
-                case ValueType::Integer: integer = source.integer; break;
-                case ValueType::Number: number = source.number; break;
-                case ValueType::Boolean: boolean = source.boolean; break;
-                case ValueType::String: new (&string) std::string(source.string); break;
-                case ValueType::List: new (&list) std::shared_ptr(source.list); break;
-                case ValueType::Map: new (&map) std::shared_ptr(source.map); break;
-                case ValueType::Extern: external = source.external; break;
-            }
+        /// @brief Returns whether the payload lives on the heap.
+        bool isBoxed() const {
+            return tag == ValueType::String || tag == ValueType::List || tag == ValueType::Map;
         }
 
-        Value(): boolean{false}, id(counter++), tag(ValueType::Null) {}
+        Value(): integer(0), tag(ValueType::Null) {}
 
         ~Value() {
-            if (tag == ValueType::String) string.~basic_string();
-            if (tag == ValueType::List) list.~shared_ptr();
-            if (tag == ValueType::Map) map.~shared_ptr();
+            if (isBoxed() && --object->refs == 0) destroy();
         }
 
-        Value(const Value& source): tag(source.tag), id(source.id) {
-            initFrom(source);
+        Value(const Value& source): integer(source.integer), tag(source.tag) {
+            if (isBoxed()) {
+                object->refs++;
+                counters::count(&counters::Counts::copies);
+            }
         }
 
         Value& operator=(const Value& source) {
+            // Take the new reference first, in case the source is only kept alive by what we're overwriting
+            if (source.isBoxed()) {
+                source.object->refs++;
+                counters::count(&counters::Counts::copies);
+            }
             this->~Value();
-            initFrom(source);
+            integer = source.integer;
+            tag = source.tag;
+            return *this;
+        }
+
+        /// Moving steals the payload outright, leaving the source null, so no reference count is touched.
+        Value(Value&& source) noexcept: integer(source.integer), tag(source.tag) {
+            source.tag = ValueType::Null;
+        }
+
+        Value& operator=(Value&& source) noexcept {
+            if (this == &source) return *this;
+            this->~Value();
+            integer = source.integer;
+            tag = source.tag;
+            source.tag = ValueType::Null;
             return *this;
         }
 
@@ -89,7 +147,7 @@ namespace value {
                 case ValueType::Integer: return integer == other.integer;
                 case ValueType::Number: return number == other.number;
                 case ValueType::Boolean: return boolean == other.boolean;
-                case ValueType::String: return string == other.string;
+                case ValueType::String: return *string == *other.string;
                 case ValueType::List: return list == other.list;
                 case ValueType::Map: return map == other.map;
                 case ValueType::Extern: return external == other.external;
@@ -97,12 +155,20 @@ namespace value {
             return false;
         }
 
-        explicit Value(const int64_t val): tag(ValueType::Integer), integer{val}, id(counter++) {}
-        explicit Value(const double val): tag(ValueType::Number), number{val}, id(counter++) {}
-        explicit Value(const bool val): tag(ValueType::Boolean), boolean{val}, id(counter++) {}
-        explicit Value(std::string val): tag(ValueType::String), string{std::move(val)}, id(counter++) {}
-        explicit Value(const std::shared_ptr<std::vector<Value>>& val): tag(ValueType::List), list{val}, id(counter++) {}
-        explicit Value(const std::shared_ptr<std::unordered_map<std::string, Value>>& val): tag(ValueType::Map), map{val}, id(counter++) {}
+        explicit Value(const int64_t val): integer{val}, tag(ValueType::Integer) {}
+        explicit Value(const double val): number{val}, tag(ValueType::Number) {}
+        explicit Value(const bool val): integer(0), tag(ValueType::Boolean) { boolean = val; }
+        explicit Value(std::string val): string{new Boxed<std::string>(std::move(val))}, tag(ValueType::String) {
+            counters::count(&counters::Counts::allocations);
+        }
+        // Without this, string literals would convert to bool instead of std::string.
+        explicit Value(const char* val): Value(std::string(val)) {}
+        explicit Value(value::List val): list{new Boxed<value::List>(std::move(val))}, tag(ValueType::List) {
+            counters::count(&counters::Counts::allocations);
+        }
+        explicit Value(value::Map val): map{new Boxed<value::Map>(std::move(val))}, tag(ValueType::Map) {
+            counters::count(&counters::Counts::allocations);
+        }
 
         // Note: This can't actually be a constructor! It would clash with the string one.
         static Value fromPointer(void* ptr) {
@@ -135,7 +201,7 @@ namespace value {
                 case ValueType::Boolean: return boolean;
                 case ValueType::Integer: return integer > 0;
                 case ValueType::Number: return number > 0;
-                case ValueType::String: return !string.empty();
+                case ValueType::String: return !string->empty();
                 case ValueType::List: return !list->empty();
                 case ValueType::Map: return !map->empty();
                 case ValueType::Extern: return false;
@@ -143,23 +209,45 @@ namespace value {
             }
         }
 
-        std::string raw_string(std::unordered_set<unsigned long long> seenIds = {}) const;
+        std::string raw_string() const;
         std::string to_string() const {
-            return tag == ValueType::String ? string : raw_string();
+            return tag == ValueType::String ? *string : raw_string();
         };
 
         std::string asString() const {
             return to_string();
         }
 
-        bool asList(std::shared_ptr<std::vector<Value>> & out) const {
+        /// @brief Gets the list this holds. The handle is only valid for as long as this value is.
+        bool asList(Ref<value::List> & out) const {
             if (tag == ValueType::List) out = list;
             return tag == ValueType::List;
         }
 
-        bool asMap(std::shared_ptr<std::unordered_map<std::string, Value>> & out) const {
+        /// @brief Gets the map this holds. The handle is only valid for as long as this value is.
+        bool asMap(Ref<value::Map> & out) const {
             if (tag == ValueType::Map) out = map;
             return tag == ValueType::Map;
         }
+
+        /// @brief Returns a copy of this value with newly allocated lists and maps, all the way down.
+        /// This doesn't look out for cycles, so it's only meant for values built from literals.
+        Value deepCopy() const;
+
+        /// @brief Gets the symbol a map would store this value under.
+        /// @param create Whether to add the key to the table if it isn't there already. Keys added here are counted,
+        /// and leave the table once no map or string refers to them.
+        /// A string that isn't in the table can't be a key in any map, so lookups can skip that.
+        /// @return Whether there is a symbol for the key.
+        bool asKey(intern::Symbol & out, bool create) const;
+
+    private:
+        /// @brief Frees the boxed payload once nothing references it anymore.
+        void destroy();
+
+        /// @param ancestors The containers currently being printed, to cut off cycles.
+        std::string raw_string(std::vector<const Object*> & ancestors) const;
     };
+
+    static_assert(sizeof(Value) == 16, "values should stay two words wide");
 }
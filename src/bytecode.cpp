@@ -0,0 +1,376 @@
+#include "bytecode.h"
+
+#include <sstream>
+
+#include "runtime.h"
+
+using namespace bytecode;
+using namespace parsing;
+using exceptions::FilePosition;
+using lexer::TokenType;
+using value::Value;
+
+std::string bytecode::to_string(const Opcode op) {
+    switch (op) {
+#define X(name) case Opcode::name: return #name;
+        BYTECODE_OPCODES(X)
+#undef X
+        default: return "???";
+    }
+}
+
+std::string Chunk::to_string() const {
+    std::ostringstream ss;
+    for (size_t i = 0; i < code.size(); i++) {
+        const auto& instr = code[i];
+        ss << i << "\t" << positions[i].to_string() << "\t" << bytecode::to_string(instr.op);
+        switch (instr.op) {
+            case Opcode::PUSH_CONST:
+            case Opcode::PUSH_COPY:
+            case Opcode::THROW:
+                ss << " " << constants[instr.a].raw_string();
+                break;
+            case Opcode::LOAD_GLOBAL:
+            case Opcode::STORE_GLOBAL:
+                ss << " " << paths[instr.a].to_string();
+                break;
+            case Opcode::CALL:
+            case Opcode::TAIL_CALL:
+                ss << " " << paths[instr.a].to_string() << " " << instr.b;
+                break;
+            case Opcode::PUSH_NULL:
+            case Opcode::POP:
+            case Opcode::INDEX:
+            case Opcode::TRY_INDEX:
+            case Opcode::STORE_INDEX:
+            case Opcode::TRY_END:
+            case Opcode::RETURN:
+                break;
+            default:
+                ss << " " << instr.a;
+        }
+        ss << std::endl;
+    }
+    return ss.str();
+}
+
+#define IF_DOWNCAST(type, name, ptr) if (auto name = dynamic_cast<type *>(ptr))
+
+namespace {
+    FilePosition assigned(Expression * place, Expression * value);
+
+    /// @brief Finds where the tree-walker leaves a frame's source position after evaluating an expression.
+    /// Backtraces show a caller at wherever its last argument left it, so calls here are made from the same place.
+    /// Where that depends on which way a branch goes at runtime, this assumes its right hand side runs.
+    /// @param before The position the frame was at beforehand.
+    FilePosition settled(Expression * expr, const FilePosition before) {
+        IF_DOWNCAST(BinaryOp, bin, expr) {
+            if (bin->opr == TokenType::PUNC_EQ) return assigned(bin->lhs, bin->rhs);
+            return settled(bin->rhs, bin->rhs->position);
+        } else IF_DOWNCAST(UnaryOp, unary, expr) {
+            return settled(unary->value, expr->position);
+        } else IF_DOWNCAST(Ternary, tern, expr) {
+            return settled(tern->rhs, settled(tern->predicate, expr->position));
+        } else IF_DOWNCAST(Call, call, expr) {
+            if (call->arguments.empty()) return expr->position;
+            const auto last = call->arguments.back();
+            return settled(last, last->position);
+        } else IF_DOWNCAST(List, list, expr) {
+            if (list->constant.getTag() == Value::ValueType::List || list->members.empty()) return expr->position;
+            const auto last = list->members.back();
+            return settled(last, last->position);
+        } else IF_DOWNCAST(Map, map, expr) {
+            // Pairs are evaluated in the order the map holds them, without moving the position to each one
+            auto pos = expr->position;
+            if (map->constant.getTag() == Value::ValueType::Map) return pos;
+            for (const auto& pair : map->pairs)
+                pos = settled(pair.second, pos);
+            return pos;
+        }
+        // Literals and paths leave it alone
+        return before;
+    }
+
+    /// @brief Finds where the tree-walker leaves a frame's source position after assigning to a place.
+    FilePosition assigned(Expression * place, Expression * value) {
+        IF_DOWNCAST(Ternary, tern, place) return assigned(tern->rhs, value);
+        // Indexes move back to themselves once everything is evaluated
+        if (dynamic_cast<BinaryOp *>(place) != nullptr) return place->position;
+        return settled(value, value->position);
+    }
+
+    /// Lowers a single function body into a chunk.
+    class Compiler {
+        struct LoopLabels {
+            size_t start;
+            size_t tryDepth;
+            std::vector<size_t> breaks {};
+        };
+
+        Chunk & chunk;
+        std::vector<LoopLabels> loops {};
+        size_t tryDepth = 0;
+
+    public:
+        explicit Compiler(Chunk & chunk) : chunk(chunk) {}
+
+        size_t emit(const Opcode op, const FilePosition pos, const uint32_t a = 0, const uint32_t b = 0) {
+            chunk.code.push_back({ op, a, b });
+            chunk.positions.push_back(pos);
+            return chunk.code.size() - 1;
+        }
+
+        /// Points a previously emitted jump at the next instruction.
+        void patch(const size_t jump) {
+            chunk.code[jump].a = chunk.code.size();
+        }
+
+        uint32_t constant(const Value & value) {
+            chunk.constants.push_back(value);
+            return chunk.constants.size() - 1;
+        }
+
+        uint32_t path(const Path & path) {
+            chunk.paths.push_back(path);
+            return chunk.paths.size() - 1;
+        }
+
+        /// @brief Adds the path a call resolves.
+        /// The tree-walker resolves a function before evaluating any arguments, so the path is resolved from the
+        /// position of the call itself.
+        uint32_t target(const Call & call) {
+            const auto index = path(call.functionPath);
+            chunk.paths[index].position = call.position;
+            return index;
+        }
+
+        /// @brief Gets the position a call is made from, which is where evaluating its arguments left the frame.
+        static FilePosition callSite(Call * call) {
+            return settled(call, call->position);
+        }
+
+        void raise(const std::string & message, const FilePosition pos) {
+            emit(Opcode::THROW, pos, constant(Value(message)));
+        }
+
+        void statement(Statement * stmt) {
+            const auto pos = stmt->position;
+            IF_DOWNCAST(Block, block, stmt) {
+                for (const auto& child : block->statements)
+                    statement(child);
+            } else IF_DOWNCAST(ExpressionStatement, expr, stmt) {
+                // Assignments evaluate to null, which would only be pushed to be popped again
+                auto bin = dynamic_cast<BinaryOp *>(expr->expr);
+                if (bin && bin->opr == TokenType::PUNC_EQ) return assign(bin->lhs, bin->rhs);
+                expression(expr->expr);
+                emit(Opcode::POP, pos);
+            } else IF_DOWNCAST(IfElse, ifelse, stmt) {
+                expression(ifelse->predicate);
+                auto skipTrue = emit(Opcode::JUMP_IF_FALSE, pos);
+                if (ifelse->truePath) statement(ifelse->truePath);
+                if (ifelse->falsePath) {
+                    auto skipFalse = emit(Opcode::JUMP, pos);
+                    patch(skipTrue);
+                    statement(ifelse->falsePath);
+                    patch(skipFalse);
+                } else patch(skipTrue);
+            } else IF_DOWNCAST(TryRecover, tryrecv, stmt) {
+                auto handler = emit(Opcode::TRY_BEGIN, pos);
+                tryDepth++;
+                statement(tryrecv->happyPath);
+                tryDepth--;
+                emit(Opcode::TRY_END, pos);
+                auto skipRecover = emit(Opcode::JUMP, pos);
+                patch(handler);
+                // The error message is on top of the stack here
+                if (tryrecv->binding.members.empty()) {
+                    emit(Opcode::POP, pos);
+                } else {
+                    store(tryrecv->binding, pos);
+                    statement(tryrecv->sadPath);
+                }
+                patch(skipRecover);
+            } else IF_DOWNCAST(Loop, loop, stmt) {
+                loops.push_back({ chunk.code.size(), tryDepth });
+                statement(loop->body);
+                emit(Opcode::JUMP, pos, loops.back().start);
+                for (auto jump : loops.back().breaks) patch(jump);
+                loops.pop_back();
+            } else IF_DOWNCAST(Declaration, decl, stmt) {
+                expression(decl->value);
+                emit(Opcode::STORE_LOCAL, pos, decl->slot);
+            } else if (dynamic_cast<Break *>(stmt) != nullptr) {
+                if (loops.empty()) return raise("unhandled break statement", pos);
+                exitTries(pos);
+                loops.back().breaks.push_back(emit(Opcode::JUMP, pos));
+            } else if (dynamic_cast<Continue *>(stmt) != nullptr) {
+                if (loops.empty()) return raise("unhandled continue statement", pos);
+                exitTries(pos);
+                emit(Opcode::JUMP, pos, loops.back().start);
+            } else IF_DOWNCAST(Return, ret, stmt) {
+                if (ret->tailCall) {
+                    const auto call = static_cast<Call *>(ret->value);
+                    for (const auto& arg : call->arguments)
+                        expression(arg);
+                    emit(Opcode::TAIL_CALL, callSite(call), target(*call), call->arguments.size());
+                    return;
+                }
+                expression(ret->value);
+                emit(Opcode::RETURN, pos);
+            } else
+                raise("internal error: could not downcast " + stmt->to_string(), pos);
+        }
+
+        /// Removes the error handlers installed since the innermost loop began.
+        void exitTries(const FilePosition pos) {
+            for (auto i = loops.back().tryDepth; i < tryDepth; i++)
+                emit(Opcode::TRY_END, pos);
+        }
+
+        void expression(Expression * expr) {
+            const auto pos = expr->position;
+            IF_DOWNCAST(Literal, lit, expr) {
+                if (lit->value.getTag() == Value::ValueType::Null)
+                    emit(Opcode::PUSH_NULL, pos);
+                else
+                    emit(Opcode::PUSH_CONST, pos, constant(lit->value));
+            } else IF_DOWNCAST(Path, name, expr) {
+                if (name->binding == Binding::LOCAL)
+                    emit(Opcode::LOAD_LOCAL, pos, name->slot);
+                else
+                    emit(Opcode::LOAD_GLOBAL, pos, path(*name));
+            } else IF_DOWNCAST(BinaryOp, bin, expr) {
+                binary(*bin);
+            } else IF_DOWNCAST(UnaryOp, unary, expr) {
+                if (unary->opr != TokenType::PUNC_NOT)
+                    return raise("internal error: UnaryOp opr was not a valid operand: " + unary->opr.to_string(), pos);
+                expression(unary->value);
+                emit(Opcode::NOT, pos);
+            } else IF_DOWNCAST(Ternary, tern, expr) {
+                expression(tern->predicate);
+                auto skipLhs = emit(Opcode::JUMP_IF_FALSE, pos);
+                expression(tern->lhs);
+                auto skipRhs = emit(Opcode::JUMP, pos);
+                patch(skipLhs);
+                expression(tern->rhs);
+                patch(skipRhs);
+            } else IF_DOWNCAST(Call, call, expr) {
+                for (const auto& arg : call->arguments)
+                    expression(arg);
+                emit(Opcode::CALL, callSite(call), target(*call), call->arguments.size());
+            } else IF_DOWNCAST(List, list, expr) {
+                if (list->constant.getTag() == Value::ValueType::List) {
+                    emit(Opcode::PUSH_COPY, pos, constant(list->constant));
+                    return;
+                }
+                for (const auto& member : list->members)
+                    expression(member);
+                emit(Opcode::MAKE_LIST, pos, list->members.size());
+            } else IF_DOWNCAST(Map, map, expr) {
+                if (map->constant.getTag() == Value::ValueType::Map) {
+                    emit(Opcode::PUSH_COPY, pos, constant(map->constant));
+                    return;
+                }
+                std::vector<intern::Symbol> keys;
+                keys.reserve(map->pairs.size());
+                for (const auto& pair : map->pairs) {
+                    expression(pair.second);
+                    keys.push_back(pair.first);
+                }
+                chunk.keyLists.push_back(std::move(keys));
+                emit(Opcode::MAKE_MAP, pos, chunk.keyLists.size() - 1);
+            } else
+                raise("internal error: cannot evaluate expression: " + expr->to_string(), pos);
+        }
+
+        void binary(const BinaryOp & bin) {
+            const auto pos = bin.position;
+            Opcode op;
+            switch (bin.opr.inner()) {
+                case TokenType::PUNC_EQ:
+                    assign(bin.lhs, bin.rhs);
+                    emit(Opcode::PUSH_NULL, pos);
+                    return;
+                case TokenType::PUNC_AND:
+                case TokenType::PUNC_OR: {
+                    expression(bin.lhs);
+                    auto shortCircuit = emit(
+                        bin.opr == TokenType::PUNC_AND ? Opcode::JUMP_IF_FALSE_OR_POP : Opcode::JUMP_IF_TRUE_OR_POP,
+                        pos
+                    );
+                    expression(bin.rhs);
+                    emit(Opcode::TO_BOOL, pos);
+                    patch(shortCircuit);
+                    return;
+                }
+                case TokenType::PUNC_INDEX: op = Opcode::INDEX; break;
+                case TokenType::PUNC_TRY_INDEX: op = Opcode::TRY_INDEX; break;
+                case TokenType::PUNC_PLUS: op = Opcode::ADD; break;
+                case TokenType::PUNC_MINUS: op = Opcode::SUB; break;
+                case TokenType::PUNC_MULT: op = Opcode::MULT; break;
+                case TokenType::PUNC_DIV: op = Opcode::DIV; break;
+                case TokenType::PUNC_MOD: op = Opcode::MOD; break;
+                case TokenType::PUNC_DOUBLE_EQ: op = Opcode::EQ; break;
+                case TokenType::PUNC_NEQ: op = Opcode::NEQ; break;
+                case TokenType::PUNC_LT: op = Opcode::LT; break;
+                case TokenType::PUNC_GT: op = Opcode::GT; break;
+                case TokenType::PUNC_LEQ: op = Opcode::LEQ; break;
+                case TokenType::PUNC_GEQ: op = Opcode::GEQ; break;
+                case TokenType::PUNC_AMPERSAND: op = Opcode::BIT_AND; break;
+                case TokenType::PUNC_BITOR: op = Opcode::BIT_OR; break;
+                case TokenType::PUNC_XOR: op = Opcode::XOR; break;
+                case TokenType::PUNC_SHL: op = Opcode::SHL; break;
+                case TokenType::PUNC_SHR: op = Opcode::SHR; break;
+                default:
+                    return raise("internal error: BinaryOp opr was not a valid operand: " + bin.opr.to_string(), pos);
+            }
+            expression(bin.lhs);
+            expression(bin.rhs);
+            emit(op, pos);
+        }
+
+        /// Pops the top of the stack into a variable.
+        void store(const Path & name, const FilePosition pos) {
+            if (name.binding == Binding::LOCAL)
+                emit(Opcode::STORE_LOCAL, pos, name.slot);
+            else
+                emit(Opcode::STORE_GLOBAL, pos, path(name));
+        }
+
+        /// Stores the result of an expression into the place another expression names.
+        void assign(Expression * place, Expression * value) {
+            const auto pos = place->position;
+            IF_DOWNCAST(Path, name, place) {
+                expression(value);
+                store(*name, pos);
+            } else IF_DOWNCAST(Ternary, tern, place) {
+                // Only one of the arms runs, so the value can be compiled into both
+                expression(tern->predicate);
+                auto skipLhs = emit(Opcode::JUMP_IF_FALSE, pos);
+                assign(tern->lhs, value);
+                auto skipRhs = emit(Opcode::JUMP, pos);
+                patch(skipLhs);
+                assign(tern->rhs, value);
+                patch(skipRhs);
+            } else IF_DOWNCAST(BinaryOp, bin, place) {
+                if (bin->opr != TokenType::PUNC_INDEX)
+                    return raise("expression does not support assignment: " + bin->lhs->to_string(), pos);
+                expression(bin->lhs);
+                expression(bin->rhs);
+                expression(value);
+                emit(Opcode::STORE_INDEX, pos, constant(Value("expression does not support assignment: " + bin->lhs->to_string())));
+            } else
+                raise("expression does not support assignment: " + place->to_string(), pos);
+        }
+    };
+}
+
+std::shared_ptr<Chunk> bytecode::compile(const runtime::SyntaxFunction & function) {
+    auto chunk = std::make_shared<Chunk>();
+    Compiler compiler { *chunk };
+    for (const auto& stmt : function.body)
+        compiler.statement(stmt);
+    compiler.emit(Opcode::PUSH_NULL, function.pos);
+    compiler.emit(Opcode::RETURN, function.pos);
+    return chunk;
+}
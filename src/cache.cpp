@@ -0,0 +1,580 @@
+#include "cache.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace parsing;
+using value::Value;
+
+bool cache::enabled = true;
+
+#define IF_DOWNCAST(type, name, ptr) if (auto name = dynamic_cast<type *>(ptr))
+
+namespace {
+    /// Bump this whenever the layout below or the syntax tree changes shape.
+    constexpr uint32_t VERSION = 4;
+    constexpr char MAGIC[8] = { 'S', 'P', 'L', 'C', 'A', 'C', 'H', 'E' };
+
+    /// What kind of node comes next in the stream.
+    enum struct Tag : uint8_t {
+        NONE,
+        BLOCK, EXPRESSION_STATEMENT, IF_ELSE, TRY_RECOVER, LOOP, DECLARATION, BREAK, CONTINUE, RETURN,
+        LITERAL, PATH, BINARY_OP, UNARY_OP, TERNARY, CALL, LIST, MAP,
+        USE, FUNCTION
+    };
+
+    /// FNV-1a, which is plenty to notice a file changing.
+    uint64_t fnv1a(const std::string_view data) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (const unsigned char byte : data) {
+            hash ^= byte;
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    /// The fields a cache entry has to match to be used.
+    struct Header {
+        uint64_t mtime;
+        uint64_t size;
+        uint64_t hash;
+
+        static bool of(const std::filesystem::path & path, const std::string_view source, Header & out) {
+            std::error_code err;
+            const auto time = std::filesystem::last_write_time(path, err);
+            if (err) return false;
+            out.mtime = time.time_since_epoch().count();
+            out.size = source.size();
+            out.hash = fnv1a(source);
+            return true;
+        }
+    };
+
+    std::filesystem::path entryFor(const std::filesystem::path & directory, const std::filesystem::path & path) {
+        std::ostringstream name;
+        name << std::hex << fnv1a(path.string()) << ".splc";
+        return directory / name.str();
+    }
+
+    /// Thrown when a cache file doesn't hold what it should.
+    struct Corrupt {};
+
+    class Writer {
+        std::string & out;
+    public:
+        explicit Writer(std::string & out) : out(out) {}
+
+        template<typename T>
+        void raw(const T value) {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+
+        void tag(const Tag tag) { raw(tag); }
+
+        void string(const std::string_view string) {
+            raw<uint32_t>(string.size());
+            out.append(string);
+        }
+
+        void position(const exceptions::FilePosition & pos) {
+            raw<uint32_t>(pos.line);
+            raw<uint32_t>(pos.column);
+        }
+
+        void path(const Path & path) {
+            position(path.position);
+            raw<uint32_t>(path.members.size());
+            for (const auto& member : path.members)
+                string(member.str());
+        }
+
+        void literal(const Value & value) {
+            raw(value.getTag());
+            switch (value.getTag()) {
+                case Value::ValueType::Null: break;
+                case Value::ValueType::Integer: raw(value.integer); break;
+                case Value::ValueType::Number: raw(value.number); break;
+                case Value::ValueType::Boolean: raw<uint8_t>(value.boolean); break;
+                case Value::ValueType::String: string(*value.string); break;
+                // The parser never makes anything else
+                default: throw Corrupt {};
+            }
+        }
+
+        void statement(Statement * stmt) {
+            if (!stmt) return tag(Tag::NONE);
+            IF_DOWNCAST(Block, block, stmt) {
+                tag(Tag::BLOCK);
+                position(stmt->position);
+                raw<uint32_t>(block->statements.size());
+                for (const auto& child : block->statements)
+                    statement(child);
+            } else IF_DOWNCAST(ExpressionStatement, expr, stmt) {
+                tag(Tag::EXPRESSION_STATEMENT);
+                position(stmt->position);
+                expression(expr->expr);
+            } else IF_DOWNCAST(IfElse, ifelse, stmt) {
+                tag(Tag::IF_ELSE);
+                position(stmt->position);
+                expression(ifelse->predicate);
+                statement(ifelse->truePath);
+                statement(ifelse->falsePath);
+            } else IF_DOWNCAST(TryRecover, tryrecv, stmt) {
+                tag(Tag::TRY_RECOVER);
+                position(stmt->position);
+                statement(tryrecv->happyPath);
+                path(tryrecv->binding);
+                statement(tryrecv->sadPath);
+            } else IF_DOWNCAST(Loop, loop, stmt) {
+                tag(Tag::LOOP);
+                position(stmt->position);
+                statement(loop->body);
+            } else IF_DOWNCAST(Declaration, decl, stmt) {
+                declaration(*decl);
+            } else if (dynamic_cast<Break *>(stmt) != nullptr) {
+                tag(Tag::BREAK);
+                position(stmt->position);
+            } else if (dynamic_cast<Continue *>(stmt) != nullptr) {
+                tag(Tag::CONTINUE);
+                position(stmt->position);
+            } else IF_DOWNCAST(Return, ret, stmt) {
+                tag(Tag::RETURN);
+                position(stmt->position);
+                expression(ret->value);
+            } else throw Corrupt {};
+        }
+
+        void declaration(const Declaration & decl) {
+            tag(Tag::DECLARATION);
+            // Declarations are both statements and items, and the parser only fills in the position of whichever
+            // one it's parsing
+            position(static_cast<const Statement &>(decl).position);
+            position(static_cast<const Item &>(decl).position);
+            string(decl.name.str());
+            expression(decl.value);
+        }
+
+        void expression(Expression * expr) {
+            if (!expr) return tag(Tag::NONE);
+            IF_DOWNCAST(Literal, lit, expr) {
+                tag(Tag::LITERAL);
+                position(expr->position);
+                literal(lit->value);
+            } else IF_DOWNCAST(Path, name, expr) {
+                tag(Tag::PATH);
+                path(*name);
+            } else IF_DOWNCAST(BinaryOp, bin, expr) {
+                tag(Tag::BINARY_OP);
+                position(expr->position);
+                raw<uint16_t>(bin->opr.inner());
+                expression(bin->lhs);
+                expression(bin->rhs);
+            } else IF_DOWNCAST(UnaryOp, unary, expr) {
+                tag(Tag::UNARY_OP);
+                position(expr->position);
+                raw<uint16_t>(unary->opr.inner());
+                expression(unary->value);
+            } else IF_DOWNCAST(Ternary, tern, expr) {
+                tag(Tag::TERNARY);
+                position(expr->position);
+                expression(tern->predicate);
+                expression(tern->lhs);
+                expression(tern->rhs);
+            } else IF_DOWNCAST(Call, call, expr) {
+                tag(Tag::CALL);
+                position(expr->position);
+                path(call->functionPath);
+                raw<uint32_t>(call->arguments.size());
+                for (const auto& arg : call->arguments)
+                    expression(arg);
+            } else IF_DOWNCAST(List, list, expr) {
+                tag(Tag::LIST);
+                position(expr->position);
+                raw<uint32_t>(list->members.size());
+                for (const auto& member : list->members)
+                    expression(member);
+            } else IF_DOWNCAST(Map, map, expr) {
+                tag(Tag::MAP);
+                position(expr->position);
+                raw<uint32_t>(map->pairs.size());
+                for (const auto& pair : map->pairs) {
+                    string(pair.first.str());
+                    expression(pair.second);
+                }
+            } else throw Corrupt {};
+        }
+
+        void item(Item * item) {
+            IF_DOWNCAST(Use, use, item) {
+                tag(Tag::USE);
+                position(item->position);
+                path(use->module);
+            } else IF_DOWNCAST(Function, fn, item) {
+                tag(Tag::FUNCTION);
+                position(item->position);
+                string(fn->name.str());
+                raw<uint32_t>(fn->arguments.size());
+                for (const auto& arg : fn->arguments)
+                    string(arg.str());
+                statement(fn->body);
+            } else IF_DOWNCAST(Declaration, decl, item) {
+                declaration(*decl);
+            } else throw Corrupt {};
+        }
+    };
+
+    class Reader {
+        const char * cursor;
+        const char * end;
+        /// Where the nodes being read are made.
+        Arena & arena;
+    public:
+        Reader(const char * data, const size_t size, Arena & arena) : cursor(data), end(data + size), arena(arena) {}
+
+        bool done() const { return cursor == end; }
+
+        template<typename T>
+        T raw() {
+            if (end - cursor < (ptrdiff_t) sizeof(T)) throw Corrupt {};
+            T value;
+            std::memcpy(&value, cursor, sizeof(T));
+            cursor += sizeof(T);
+            return value;
+        }
+
+        Tag tag() { return raw<Tag>(); }
+
+        std::string_view string() {
+            const auto size = raw<uint32_t>();
+            if (end - cursor < (ptrdiff_t) size) throw Corrupt {};
+            std::string_view string { cursor, size };
+            cursor += size;
+            return string;
+        }
+
+        /// @brief Reads how many of something follow, each taking at least `minimum` bytes.
+        /// A count the rest of the file couldn't hold is corrupt, so it never gets as far as a reservation.
+        uint32_t count(const size_t minimum) {
+            const auto count = raw<uint32_t>();
+            if ((size_t) count > (size_t) (end - cursor) / minimum) throw Corrupt {};
+            return count;
+        }
+
+        exceptions::FilePosition position() {
+            exceptions::FilePosition pos;
+            pos.line = raw<uint32_t>();
+            pos.column = raw<uint32_t>();
+            return pos;
+        }
+
+        void path(Path & path) {
+            path.position = position();
+            const auto count = this->count(sizeof(uint32_t));
+            path.members.reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+                path.members.emplace_back(string());
+        }
+
+        Value literal() {
+            switch (raw<Value::ValueType>()) {
+                case Value::ValueType::Null: return {};
+                case Value::ValueType::Integer: return Value(raw<int64_t>());
+                case Value::ValueType::Number: return Value(raw<double>());
+                case Value::ValueType::Boolean: return Value((bool) raw<uint8_t>());
+                case Value::ValueType::String: return Value(std::string(string()));
+                default: throw Corrupt {};
+            }
+        }
+
+        lexer::TokenType opr() {
+            return lexer::TokenType((lexer::TokenType::Value) raw<uint16_t>());
+        }
+
+        template<typename T>
+        T * node(const exceptions::FilePosition pos) {
+            auto node = arena.make<T>();
+            node->position = pos;
+            return node;
+        }
+
+        Declaration * declaration() {
+            auto decl = arena.make<Declaration>();
+            static_cast<Statement &>(*decl).position = position();
+            static_cast<Item &>(*decl).position = position();
+            decl->name = string();
+            decl->value = required(expression());
+            return decl;
+        }
+
+        template<typename T>
+        static T * required(T * node) {
+            if (!node) throw Corrupt {};
+            return node;
+        }
+
+        Statement * statement() {
+            const auto kind = tag();
+            if (kind == Tag::NONE) return nullptr;
+            if (kind == Tag::DECLARATION) return declaration();
+            const auto pos = position();
+            switch (kind) {
+                case Tag::BLOCK: {
+                    auto block = node<Block>(pos);
+                    const auto count = this->count(sizeof(Tag));
+                    for (uint32_t i = 0; i < count; i++)
+                        block->statements.push_back(required(statement()));
+                    return block;
+                }
+                case Tag::EXPRESSION_STATEMENT: {
+                    auto expr = node<ExpressionStatement>(pos);
+                    expr->expr = required(expression());
+                    return expr;
+                }
+                case Tag::IF_ELSE: {
+                    auto ifelse = node<IfElse>(pos);
+                    ifelse->predicate = required(expression());
+                    ifelse->truePath = statement();
+                    ifelse->falsePath = statement();
+                    return ifelse;
+                }
+                case Tag::TRY_RECOVER: {
+                    auto tryrecv = node<TryRecover>(pos);
+                    tryrecv->happyPath = statement();
+                    path(tryrecv->binding);
+                    tryrecv->sadPath = statement();
+                    return tryrecv;
+                }
+                case Tag::LOOP: {
+                    auto loop = node<Loop>(pos);
+                    loop->body = statement();
+                    return loop;
+                }
+                case Tag::BREAK: return node<Break>(pos);
+                case Tag::CONTINUE: return node<Continue>(pos);
+                case Tag::RETURN: {
+                    auto ret = node<Return>(pos);
+                    ret->value = required(expression());
+                    return ret;
+                }
+                default: throw Corrupt {};
+            }
+        }
+
+        Expression * expression() {
+            const auto kind = tag();
+            if (kind == Tag::NONE) return nullptr;
+            if (kind == Tag::PATH) {
+                auto name = arena.make<Path>();
+                path(*name);
+                return name;
+            }
+            const auto pos = position();
+            switch (kind) {
+                case Tag::LITERAL: {
+                    auto lit = arena.make<Literal>(literal());
+                    lit->position = pos;
+                    return lit;
+                }
+                case Tag::BINARY_OP: {
+                    auto bin = arena.make<BinaryOp>(opr());
+                    bin->position = pos;
+                    bin->lhs = required(expression());
+                    bin->rhs = required(expression());
+                    return bin;
+                }
+                case Tag::UNARY_OP: {
+                    auto unary = arena.make<UnaryOp>(opr());
+                    unary->position = pos;
+                    unary->value = required(expression());
+                    return unary;
+                }
+                case Tag::TERNARY: {
+                    auto tern = node<Ternary>(pos);
+                    tern->predicate = required(expression());
+                    tern->lhs = required(expression());
+                    tern->rhs = required(expression());
+                    return tern;
+                }
+                case Tag::CALL: {
+                    auto call = node<Call>(pos);
+                    path(call->functionPath);
+                    const auto count = this->count(sizeof(Tag));
+                    for (uint32_t i = 0; i < count; i++)
+                        call->arguments.push_back(required(expression()));
+                    return call;
+                }
+                case Tag::LIST: {
+                    auto list = node<List>(pos);
+                    const auto count = this->count(sizeof(Tag));
+                    for (uint32_t i = 0; i < count; i++)
+                        list->members.push_back(required(expression()));
+                    return list;
+                }
+                case Tag::MAP: {
+                    auto map = node<Map>(pos);
+                    const auto count = this->count(sizeof(uint32_t) + sizeof(Tag));
+                    for (uint32_t i = 0; i < count; i++) {
+                        intern::Symbol key { string() };
+                        map->pairs[key] = required(expression());
+                    }
+                    return map;
+                }
+                default: throw Corrupt {};
+            }
+        }
+
+        Item * item() {
+            const auto kind = tag();
+            if (kind == Tag::DECLARATION) return declaration();
+            const auto pos = position();
+            switch (kind) {
+                case Tag::USE: {
+                    auto use = node<Use>(pos);
+                    path(use->module);
+                    return use;
+                }
+                case Tag::FUNCTION: {
+                    auto fn = node<Function>(pos);
+                    fn->name = string();
+                    const auto count = this->count(sizeof(uint32_t));
+                    for (uint32_t i = 0; i < count; i++)
+                        fn->arguments.emplace_back(string());
+                    fn->body = required(statement());
+                    return fn;
+                }
+                default: throw Corrupt {};
+            }
+        }
+    };
+
+    /// A read-only mapping of a whole file, unmapped when it goes out of scope.
+    class Mapping {
+        void * data = MAP_FAILED;
+        size_t size = 0;
+    public:
+        explicit Mapping(const std::filesystem::path & path) {
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat info {};
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                size = info.st_size;
+                data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+        }
+        ~Mapping() {
+            if (data != MAP_FAILED) munmap(data, size);
+        }
+        Mapping(const Mapping &) = delete;
+        Mapping & operator=(const Mapping &) = delete;
+
+        bool valid() const { return data != MAP_FAILED; }
+        const char * bytes() const { return static_cast<const char *>(data); }
+        size_t length() const { return size; }
+    };
+}
+
+bool cache::directory(std::filesystem::path & out) {
+    if (const auto dir = getenv("SHRIMPLY_CACHE_DIR"); dir && *dir) {
+        out = dir;
+        return true;
+    }
+    if (const auto dir = getenv("XDG_CACHE_HOME"); dir && *dir) {
+        out = std::filesystem::path(dir) / "shrimply";
+        return true;
+    }
+    if (const auto home = getenv("HOME"); home && *home) {
+        out = std::filesystem::path(home) / ".cache" / "shrimply";
+        return true;
+    }
+    return false;
+}
+
+bool cache::load(const std::filesystem::path & path, const std::string_view source, Root & out) {
+    std::filesystem::path dir;
+    Header expected {};
+    if (!enabled || !directory(dir) || !Header::of(path, source, expected)) return false;
+
+    const Mapping file { entryFor(dir, path) };
+    if (!file.valid()) return false;
+    try {
+        Root root;
+        Reader reader { file.bytes(), file.length(), *root.arena };
+        for (const char chr : MAGIC)
+            if (reader.raw<char>() != chr) return false;
+        if (reader.raw<uint32_t>() != VERSION) return false;
+        if (reader.raw<uint64_t>() != expected.mtime) return false;
+        if (reader.raw<uint64_t>() != expected.size) return false;
+        if (reader.raw<uint64_t>() != expected.hash) return false;
+        // Two paths can hash to the same entry
+        if (reader.string() != path.string()) return false;
+
+        const auto count = reader.count(sizeof(Tag));
+        root.items.reserve(count);
+        for (uint32_t i = 0; i < count; i++)
+            root.items.push_back(reader.item());
+        if (!reader.done()) return false;
+        out = std::move(root);
+        return true;
+    } catch (Corrupt &) {
+        return false;
+    } catch (std::bad_alloc &) {
+        // Whatever went wrong, parsing the source is always an option
+        return false;
+    } catch (std::length_error &) {
+        return false;
+    }
+}
+
+void cache::store(const std::filesystem::path & path, const std::string_view source, const Root & root) {
+    std::filesystem::path dir;
+    Header header {};
+    if (!enabled || !directory(dir) || !Header::of(path, source, header)) return;
+
+    std::string data;
+    try {
+        Writer writer { data };
+        for (const char chr : MAGIC) writer.raw(chr);
+        writer.raw(VERSION);
+        writer.raw(header.mtime);
+        writer.raw(header.size);
+        writer.raw(header.hash);
+        writer.string(path.string());
+        writer.raw<uint32_t>(root.items.size());
+        for (const auto& item : root.items)
+            writer.item(item);
+    } catch (Corrupt &) {
+        return;
+    }
+
+    // Write to a temporary file first, so a concurrent run never maps a half-written entry
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+    if (err) return;
+    const auto entry = entryFor(dir, path);
+    auto temporary = entry;
+    temporary += "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream file ( temporary, std::ios::binary | std::ios::trunc );
+        if (!file) return;
+        file.write(data.data(), (std::streamsize) data.size());
+        if (!file) {
+            file.close();
+            std::filesystem::remove(temporary, err);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, entry, err);
+    if (err) std::filesystem::remove(temporary, err);
+}
@@ -0,0 +1,132 @@
+#include "counters.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "runtime.h"
+
+using counters::Counts;
+
+namespace {
+    /// A function whose work has been counted.
+    struct Record {
+        std::string module;
+        std::string function;
+        Counts counts;
+    };
+
+    /// Functions are told apart by the module they're in and their name, which is interned, so neither needs comparing
+    /// as a string.
+    struct Key {
+        const runtime::Module * module;
+        const char * function;
+
+        bool operator==(const Key & other) const { return module == other.module && function == other.function; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key & key) const noexcept {
+            return std::hash<const void *>{}(key.module) * 31 + std::hash<const void *>{}(key.function);
+        }
+    };
+
+    struct Native {
+        std::string name;
+        uint64_t calls = 0;
+    };
+
+    Counts outside {};
+    std::unordered_map<Key, Record, KeyHash> records {};
+    std::unordered_map<const runtime::AbstractFunction *, Native> natives {};
+
+    Counts & recordFor(const runtime::Stackframe & frame) {
+        const Key key { frame.root, frame.functionName.data() };
+        auto it = records.find(key);
+        if (it == records.end()) {
+            it = records.emplace(key, Record {
+                frame.root ? frame.root->moduleName.str() : std::string(),
+                std::string(frame.functionName),
+                {}
+            }).first;
+        }
+        return it->second.counts;
+    }
+}
+
+bool counters::enabled = false;
+Counts * counters::current = &outside;
+
+void counters::start(const runtime::Stackframe & root) {
+    enabled = true;
+    resume(root);
+}
+
+void counters::increment(uint64_t Counts::* counter) {
+    current->*counter += 1;
+}
+
+void counters::call(const runtime::Stackframe & frame) {
+    current = &recordFor(frame);
+    current->calls++;
+}
+
+void counters::resume(const runtime::Stackframe & frame) {
+    current = &recordFor(frame);
+}
+
+void counters::native(runtime::AbstractFunction & function, const parsing::Path & path) {
+    if (function.asSyntax()) return;
+    auto& native = natives[&function];
+    // The same native can be reached through more than one path, so it goes by the first one it was called through
+    if (native.name.empty()) native.name = path.to_string();
+    native.calls++;
+}
+
+void counters::print(std::ostream & stream) {
+    std::vector<const Record *> sorted {};
+    sorted.reserve(records.size());
+    for (const auto& [key, record] : records)
+        sorted.push_back(&record);
+    std::sort(sorted.begin(), sorted.end(), [](const auto left, const auto right) {
+        if (left->module != right->module) return left->module < right->module;
+        return left->function < right->function;
+    });
+
+    Counts total {};
+    constexpr int WIDTH = 14;
+    const auto row = [&](const Counts & counts, const std::string & name) {
+        stream << "    "
+            << std::setw(WIDTH) << counts.calls << std::setw(WIDTH) << counts.statements
+            << std::setw(WIDTH) << counts.expressions << std::setw(WIDTH) << counts.instructions
+            << std::setw(WIDTH) << counts.copies
+            << std::setw(WIDTH) << counts.allocations << "  " << name << std::endl;
+    };
+    stream << "counts:" << std::endl << "    "
+        << std::setw(WIDTH) << "calls" << std::setw(WIDTH) << "statements"
+        << std::setw(WIDTH) << "expressions" << std::setw(WIDTH) << "instructions"
+        << std::setw(WIDTH) << "copies"
+        << std::setw(WIDTH) << "allocations" << "  function" << std::endl;
+    for (const auto record : sorted) {
+        const auto& counts = record->counts;
+        row(counts, record->module + "::" + record->function);
+        total.calls += counts.calls;
+        total.statements += counts.statements;
+        total.expressions += counts.expressions;
+        total.instructions += counts.instructions;
+        total.copies += counts.copies;
+        total.allocations += counts.allocations;
+    }
+    row(total, "(total)");
+
+    std::vector<const Native *> sortedNatives {};
+    sortedNatives.reserve(natives.size());
+    for (const auto& [function, native] : natives)
+        sortedNatives.push_back(&native);
+    std::sort(sortedNatives.begin(), sortedNatives.end(), [](const auto left, const auto right) { return left->name < right->name; });
+    stream << "native calls:" << std::endl;
+    for (const auto native : sortedNatives)
+        stream << "    " << std::setw(WIDTH) << native->calls << "  " << native->name << std::endl;
+}
@@ -8,31 +8,42 @@
 
 using namespace exceptions;
 
-SyntaxError SyntaxError::unexpectedToken(const lexer::Token &token, parsing::ParserState state, std::filesystem::path filename) {
-    return {"unexpected token [" + token.span() + "]", token.getPosition(), std::move(filename) };
+SyntaxError SyntaxError::unexpectedToken(const lexer::Token &token, std::filesystem::path filename) {
+    return {"unexpected token [" + std::string(token.span()) + "]", token.getPosition(), std::move(filename) };
 }
 
-SyntaxError SyntaxError::unexpectedToken(const lexer::Token &token, parsing::ParserState state, const lexer::TokenType expected, std::filesystem::path filename) {
-    return {"unexpected token [" + token.span() + "] (expected " + expected.to_string() + ")", token.getPosition(), std::move(filename) };
+SyntaxError SyntaxError::unexpectedToken(const lexer::Token &token, const lexer::TokenType expected, std::filesystem::path filename) {
+    return {"unexpected token [" + std::string(token.span()) + "] (expected " + expected.to_string() + ")", token.getPosition(), std::move(filename) };
 }
 
 SyntaxError SyntaxError::invalidToken(const lexer::Token &token, const std::string& why, std::filesystem::path filename) {
-    return {"failed to parse token [" + token.span() + "]: " + why, token.getPosition(), std::move(filename) };
+    return {"failed to parse token [" + std::string(token.span()) + "]: " + why, token.getPosition(), std::move(filename) };
 }
 
 RuntimeError::RuntimeError(const runtime::Stackframe &frame, std::string msg) : message(std::move(msg)) {
-    std::ostringstream ss;
-    ss << "runtime error: " << message << std::endl
-        << "backtrace:" << std::endl;
-
+    backtrace.reserve(frame.depth + 1);
     auto currentFrame = &frame;
     while (currentFrame) {
-        ss << "    " << currentFrame->sourcePos.to_string()
-            << " in " << currentFrame->functionName
-            << " (module " << currentFrame->root->moduleName << ")"
-            << std::endl;
+        backtrace.push_back({
+            currentFrame->sourcePos,
+            currentFrame->functionName,
+            currentFrame->root ? currentFrame->root->moduleName : intern::Symbol()
+        });
         currentFrame = currentFrame->parent;
     }
+}
 
+const char * RuntimeError::what() const noexcept {
+    if (!formatted.empty()) return formatted.c_str();
+    std::ostringstream ss;
+    ss << "runtime error: " << message << std::endl
+        << "backtrace:" << std::endl;
+    for (const auto& record : backtrace) {
+        ss << "    " << record.position.to_string()
+            << " in " << record.function
+            << " (module " << record.module << ")"
+            << std::endl;
+    }
     formatted = ss.str();
+    return formatted.c_str();
 }
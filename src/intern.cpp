@@ -0,0 +1,106 @@
+#include "intern.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+using intern::Entry;
+using intern::Symbol;
+
+namespace {
+    /// Every interned string. The keys view into the entries, so looking a string up never allocates.
+    struct Table {
+        std::mutex mutex {};
+        /// Whether imports are being parsed on other threads. Only then is the lock taken, so a script's own
+        /// key lookups never pay for it.
+        bool shared = false;
+        /// A deque never moves its elements when it grows, so pointers into it stay valid for the whole run.
+        std::deque<Entry> storage {};
+        std::unordered_map<std::string_view, Entry *> strings {};
+
+        std::unique_lock<std::mutex> lock() {
+            return shared ? std::unique_lock(mutex) : std::unique_lock<std::mutex>();
+        }
+
+        Entry * intern(const std::string_view string) {
+            const auto held = lock();
+            auto it = strings.find(string);
+            if (it != strings.end()) {
+                // A runtime key the parser wants too stays from now on
+                if (it->second->refs) it->second->refs = 0;
+                return it->second;
+            }
+            auto & stored = storage.emplace_back(Entry { std::string(string), 0 });
+            strings.emplace(stored.string, &stored);
+            return &stored;
+        }
+
+        /// @brief Finds a string, counting the reference the caller is about to take if it's a runtime key.
+        Entry * find(const std::string_view string) {
+            const auto held = lock();
+            const auto it = strings.find(string);
+            if (it == strings.end()) return nullptr;
+            if (it->second->refs) it->second->refs++;
+            return it->second;
+        }
+
+        /// Runtime keys are allocated on their own, so they can be freed once nothing uses them.
+        Entry * key(const std::string_view string) {
+            if (const auto found = find(string)) return found;
+            const auto held = lock();
+            const auto entry = new Entry { std::string(string), 1 };
+            strings.emplace(entry->string, entry);
+            return entry;
+        }
+
+        void release(Entry * entry) {
+            {
+                const auto held = lock();
+                strings.erase(entry->string);
+            }
+            delete entry;
+        }
+    };
+
+    /// Never destroyed, since a value still holding a runtime key can outlive it at exit.
+    Table & table() {
+        static Table & table = *new Table {};
+        return table;
+    }
+}
+
+Entry * Symbol::empty() {
+    static Entry * entry = table().intern({});
+    return entry;
+}
+
+void Symbol::release(Entry * entry) {
+    table().release(entry);
+}
+
+Symbol::Symbol(const std::string_view string) : entry(table().intern(string)) {}
+
+Symbol Symbol::key(const std::string_view string) {
+    Symbol symbol;
+    // The table already counted this reference, and the empty symbol it replaces isn't counted
+    symbol.entry = table().key(string);
+    return symbol;
+}
+
+bool Symbol::find(const std::string_view string, Symbol & out) {
+    const auto entry = table().find(string);
+    if (!entry) return false;
+    Symbol found;
+    found.entry = entry;
+    // Whatever out held is dropped outside the lock, since dropping the last reference takes it again
+    out = std::move(found);
+    return true;
+}
+
+intern::Shared::Shared() {
+    table().shared = true;
+}
+
+intern::Shared::~Shared() {
+    table().shared = false;
+}
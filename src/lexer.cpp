@@ -1,11 +1,65 @@
 #include "lexer.h"
 
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <iostream>
 #include <utility>
 #include "exceptions.h"
+#include "scan.h"
 
 using namespace lexer;
 
+using scan::is;
+
+namespace {
+    struct Keyword {
+        std::string_view word;
+        TokenType::Value type;
+    };
+
+    constexpr Keyword KEYWORDS[] = {
+        { "fn", TokenType::KW_FUNCTION },
+        { "if", TokenType::KW_IF },
+        { "else", TokenType::KW_ELSE },
+        { "loop", TokenType::KW_LOOP },
+        { "break", TokenType::KW_BREAK },
+        { "continue", TokenType::KW_CONTINUE },
+        { "return", TokenType::KW_RETURN },
+        { "true", TokenType::KW_TRUE },
+        { "false", TokenType::KW_FALSE },
+        { "null", TokenType::KW_NULL },
+        { "inf", TokenType::KW_INFINITY },
+        { "nan", TokenType::KW_NAN },
+        { "try", TokenType::KW_TRY },
+        { "recover", TokenType::KW_RECOVER },
+        { "use", TokenType::KW_USE },
+    };
+
+    /// Keywords are kept in a table indexed by a hash that gives each of them a slot of its own, so a scanned
+    /// identifier is only ever compared against one keyword.
+    constexpr size_t KEYWORD_SLOTS = 32;
+
+    constexpr size_t keywordSlot(const std::string_view word) {
+        return (word.size() + (unsigned char) word.front() * 6 + (unsigned char) word.back() * 12) % KEYWORD_SLOTS;
+    }
+
+    constexpr auto KEYWORD_TABLE = [] {
+        std::array<Keyword, KEYWORD_SLOTS> table {};
+        for (const auto& keyword : KEYWORDS)
+            table[keywordSlot(keyword.word)] = keyword;
+        return table;
+    }();
+
+    constexpr bool keywordsCollide() {
+        for (size_t i = 0; i < std::size(KEYWORDS); i++)
+            for (size_t j = i + 1; j < std::size(KEYWORDS); j++)
+                if (keywordSlot(KEYWORDS[i].word) == keywordSlot(KEYWORDS[j].word)) return true;
+        return false;
+    }
+    static_assert(!keywordsCollide(), "every keyword needs a slot of its own, so the hash has to change");
+}
+
 std::string TokenType::to_string() const {
     switch (value) {
         case KW_FUNCTION: return "fn";
@@ -29,6 +83,7 @@ std::string TokenType::to_string() const {
         case PUNC_DIV: return "/";
         case PUNC_MOD: return "%";
         case PUNC_INDEX: return ".";
+        case PUNC_TRY_INDEX: return ".?";
         case PUNC_COMMA: return ",";
         case PUNC_AND: return "&&";
         case PUNC_OR: return "||";
@@ -62,237 +117,189 @@ std::string TokenType::to_string() const {
     }
 }
 
-std::string Token::span() const {
-    if (!parent)
-        throw exceptions::SyntaxError(
-            "internal error: tried to convert a token with a nullptr parent to a string",
-            position, "???"
-        );
-    return parent->substr(start, end - start);
-}
-
 std::string Token::display() const {
-    return type.to_string() + "(\"" + span() + "\")";
+    return type.to_string() + "(\"" + std::string(span()) + "\")";
 }
 
-bool Lexer::chompString(const std::string &needle, Token & token) {
-    if (index + needle.size() > dataLength) { return false; }
-    if (rawData.substr(index, needle.size()) == needle) {
-        token.start = index;
-        index += needle.size() - 1;
-        incrementPosition();
-        token.end = index;
-        return true;
+Lexer::Lexer(const std::string_view data, std::filesystem::path filename) : data(data), filename(std::move(filename)) {
+    // Check that the file is actually ASCII
+    if (!scan::isAscii(data.data(), data.data() + data.size())) {
+        throw std::invalid_argument("file must be pure ASCII");
     }
-    return false;
+    // Skip past initial whitespace in the file
+    skipWhitespace();
 }
 
-void Lexer::skipWhitespace() {
-    while (index <= dataLength) {
-        // Get the current character, and check if it's whitespace
-        const char current = rawData[index];
-        if (!isspace(current)) return;
-        incrementPosition();
-    }
+void Lexer::advanceTo(const size_t to) {
+    const char * lastNewline = nullptr;
+    line += scan::countNewlines(data.data() + index, data.data() + to, lastNewline);
+    if (lastNewline) lineStart = lastNewline + 1 - data.data();
+    index = to;
 }
 
-Lexer::Lexer (std::string & data, std::filesystem::path  filename) : rawData(data), dataLength(data.size()), filename(std::move(filename)) {
-    // Check that the file is actually ASCII
-    for (char chr : data) {
-        if (!isascii(chr)) {
-            throw std::invalid_argument("file must be pure ASCII");
+void Lexer::skipWhitespace() {
+    // Gaps between tokens are usually a space or a line's indentation, so those are stepped over here, keeping track
+    // of lines as they go, and only longer runs are handed off to a scan
+    const auto shortEnd = std::min(data.size(), index + scan::SHORT_RUN);
+    while (index < shortEnd && is(data[index], scan::SPACE)) {
+        if (data[index] == '\n') {
+            line++;
+            lineStart = index + 1;
         }
+        index++;
     }
-    // Skip past initial whitespace in the file
-    skipWhitespace();
+    if (index == shortEnd && !atEnd() && is(data[index], scan::SPACE))
+        advanceTo(scan::skipLong(data.data() + index, data.data() + data.size(), scan::SPACE) - data.data());
 }
 
-/// Tries to match a string, and if it matches, sets the token type and returns true.
-#define IF_CHOMP_RETURN(needle, ty) if ( chompString(needle, token) ) { \
-        token.type = ty; \
-        return true; \
+void Lexer::identifier(Token & token) {
+    const auto end = scan::skip(data.data() + index + 1, data.data() + data.size(), scan::IDENT) - data.data();
+
+    // Keywords only match whole identifiers, so `format` isn't `fn` followed by `ormat`
+    const auto word = data.substr(index, end - index);
+    const auto& keyword = KEYWORD_TABLE[keywordSlot(word)];
+    token.type = keyword.word == word ? keyword.type : TokenType::IDENTIFIER;
+    index = end;
+    token.end = end;
+}
+
+void Lexer::number(Token & token) {
+    auto end = index;
+    const auto finish = [&](const TokenType::Value type) {
+        index = end;
+        token.end = end;
+        token.type = type;
+    };
+    const auto prefixed = [&](const TokenType::Value type, auto isDigit) {
+        end += 2;
+        while (end < data.size() && isDigit(data[end]))
+            end++;
+        finish(type);
+    };
+
+    if (data[end] == '0' && end + 1 < data.size()) {
+        switch (data[end + 1]) {
+            case 'x': return prefixed(TokenType::LIT_HEX_NUMBER, [](const char chr) { return isxdigit(chr); });
+            case 'b': return prefixed(TokenType::LIT_BIN_NUMBER, [](const char chr) { return chr == '0' || chr == '1'; });
+            case 'o': return prefixed(TokenType::LIT_OCT_NUMBER, [](const char chr) { return chr >= '0' && chr <= '7'; });
+            default: break;
+        }
     }
 
-void Lexer::incrementPosition() {
-    index++;
-    if (rawData[index] == '\n') {
-        position.line++;
-        position.column = 0;
+    // Decimal numbers can have a sign and a point
+    const auto digits = [&] { end = scan::skip(data.data() + end, data.data() + data.size(), scan::DIGIT) - data.data(); };
+    if (data[end] == '-') end++;
+    digits();
+    if (end < data.size() && data[end] == '.') {
+        end++;
+        digits();
     }
-    position.column++;
+    finish(TokenType::LIT_DEC_NUMBER);
 }
 
-
 bool Lexer::advanceToken(Token & token) {
     skipWhitespace();
 
+    token.source = data.data();
     token.start = index;
     token.end = index;
-    token.parent = &rawData;
+    token.position = position();
 
     if (atEnd()) {
         token.type = TokenType::END_OF_FILE;
         return false;
     }
 
-    token.type = TokenType::UNRECOGNIZED;
-    token.position = position;
-
-    // Match against a map of predetermined strings to token types.
-
-    // Keywords
-    IF_CHOMP_RETURN("fn", TokenType::KW_FUNCTION);
-    IF_CHOMP_RETURN("if", TokenType::KW_IF);
-    IF_CHOMP_RETURN("else", TokenType::KW_ELSE);
-    IF_CHOMP_RETURN("loop", TokenType::KW_LOOP);
-    IF_CHOMP_RETURN("break", TokenType::KW_BREAK);
-    IF_CHOMP_RETURN("continue", TokenType::KW_CONTINUE);
-    IF_CHOMP_RETURN("return", TokenType::KW_RETURN);
-    IF_CHOMP_RETURN("true", TokenType::KW_TRUE);
-    IF_CHOMP_RETURN("false", TokenType::KW_FALSE);
-    IF_CHOMP_RETURN("null", TokenType::KW_NULL);
-    IF_CHOMP_RETURN("inf", TokenType::KW_INFINITY);
-    IF_CHOMP_RETURN("-inf", TokenType::KW_NEG_INFINITY);
-    IF_CHOMP_RETURN("nan", TokenType::KW_NAN);
-    IF_CHOMP_RETURN("try", TokenType::KW_TRY);
-    IF_CHOMP_RETURN("recover", TokenType::KW_RECOVER);
-    IF_CHOMP_RETURN("use", TokenType::KW_USE);
-
-    // Match comments before we match punctuation
-    if ( chompString("/*", token) ) {
-        token.type = TokenType::COMMENT;
-        // Save the start, since it gets overwritten by chompString
-        auto start = token.start;
-        while ( !chompString("*/", token) ) {
-            if ( index + 2 >= dataLength ) {
-                throw exceptions::SyntaxError::unexpectedEOF(token.getPosition(), filename);
-            }
-            incrementPosition();
-        }
-        token.start = start;
-        token.end = index;
-        return true;
-    }
-
-    // Punctuation
-    IF_CHOMP_RETURN(";", TokenType::PUNC_SEMICOLON);
-    IF_CHOMP_RETURN(":=", TokenType::PUNC_DECLARATION);
-    IF_CHOMP_RETURN("::", TokenType::PUNC_SCOPE);
-    IF_CHOMP_RETURN("$", TokenType::PUNC_CALL);
-    IF_CHOMP_RETURN("+", TokenType::PUNC_PLUS);
-    IF_CHOMP_RETURN("*", TokenType::PUNC_MULT);
-    IF_CHOMP_RETURN("/", TokenType::PUNC_DIV);
-    IF_CHOMP_RETURN("%", TokenType::PUNC_MOD);
-    IF_CHOMP_RETURN(".", TokenType::PUNC_INDEX);
-    IF_CHOMP_RETURN(",", TokenType::PUNC_COMMA);
-    IF_CHOMP_RETURN("?", TokenType::PUNC_TERNARY);
-    IF_CHOMP_RETURN("&&", TokenType::PUNC_AND);
-    IF_CHOMP_RETURN("||", TokenType::PUNC_OR);
-    IF_CHOMP_RETURN("==", TokenType::PUNC_DOUBLE_EQ);
-    IF_CHOMP_RETURN("!=", TokenType::PUNC_NEQ);
-    IF_CHOMP_RETURN("<=", TokenType::PUNC_LEQ);
-    IF_CHOMP_RETURN(">=", TokenType::PUNC_GEQ);
-    IF_CHOMP_RETURN("=", TokenType::PUNC_EQ);
-    IF_CHOMP_RETURN("&", TokenType::PUNC_AMPERSAND);
-    IF_CHOMP_RETURN("|", TokenType::PUNC_BITOR);
-    IF_CHOMP_RETURN("^", TokenType::PUNC_XOR);
-    IF_CHOMP_RETURN("!", TokenType::PUNC_NOT);
-    IF_CHOMP_RETURN("<<", TokenType::PUNC_SHL);
-    IF_CHOMP_RETURN(">>", TokenType::PUNC_SHR);
-    IF_CHOMP_RETURN("[", TokenType::PUNC_L_BRACKET);
-    IF_CHOMP_RETURN("]", TokenType::PUNC_R_BRACKET);
-    IF_CHOMP_RETURN("{", TokenType::PUNC_L_BRACE);
-    IF_CHOMP_RETURN("}", TokenType::PUNC_R_BRACE);
-    IF_CHOMP_RETURN("(", TokenType::PUNC_L_PAREN);
-    IF_CHOMP_RETURN(")", TokenType::PUNC_R_PAREN);
-    IF_CHOMP_RETURN("<", TokenType::PUNC_LT);
-    IF_CHOMP_RETURN(">", TokenType::PUNC_GT);
-
-    // Match against a hexadecimal number
-    if ( chompString("0x", token) ) {
-        token.type = TokenType::LIT_HEX_NUMBER;
-
-        while ( !atEnd() && isxdigit(rawData[index]))
-            incrementPosition();
-
-        token.end = index;
-        return true;
-    }
-
-    // Match against a binary number
-    if ( chompString("0b", token) ) {
-        token.type = TokenType::LIT_BIN_NUMBER;
-
-        while ( !atEnd() && (rawData[index] == '0' || rawData[index] == '1'))
-            incrementPosition();
-
-        token.end = index;
-        return true;
-    }
-
-    // Match against an octal number
-    if ( chompString("0o", token) ) {
-        token.type = TokenType::LIT_OCT_NUMBER;
-
-        while ( !atEnd() && rawData[index] >= '0' && rawData[index] <= '7')
-            incrementPosition();
+    const auto peek = [&](const size_t offset) {
+        return index + offset < data.size() ? data[index + offset] : '\0';
+    };
+    const auto emit = [&](const TokenType::Value type, const size_t length) {
+        index += length;
         token.end = index;
+        token.type = type;
         return true;
-    }
-
-    auto currentByte = rawData[index];
-
-    // Match against a decimal number (optionally, with a point)
-    if ( isdigit(currentByte) || (
-        index + 1 < dataLength &&
-        currentByte == '-' &&
-        isdigit(rawData[index + 1])
-    ) ) {
-        if (currentByte == '-') incrementPosition();
-        token.type = TokenType::LIT_DEC_NUMBER;
-        bool foundDecimalPoint = false;
-
-        while (isdigit(rawData[index]) || (!foundDecimalPoint && rawData[index] == '.')) {
-            foundDecimalPoint |= rawData[index] == '.';
-            incrementPosition();
-            if (atEnd()) break;
-        }
-        token.end = index;
-        return true;
-    }
-
-    IF_CHOMP_RETURN("-", TokenType::PUNC_MINUS);
-
-    // Match a string
-    if ( currentByte == '"' ) {
-        token.type = TokenType::LIT_STRING;
-        bool lastWasEscape = false;
-        incrementPosition(); // Advance past the starting quote
-        if (atEnd()) throw exceptions::SyntaxError::unexpectedEOF(token.getPosition(), filename);
-        while ( lastWasEscape || rawData[index] != '\"' ) {
-            lastWasEscape = rawData[index] == '\\';
-            incrementPosition(); // Advance past the inner character
-            if (atEnd()) throw exceptions::SyntaxError::unexpectedEOF(token.getPosition(), filename);
+    };
+
+    // Every token can be told apart by its first byte, apart from a few that need one or two more
+    const auto current = data[index];
+    switch (current) {
+        case ';': return emit(TokenType::PUNC_SEMICOLON, 1);
+        case ':':
+            if (peek(1) == '=') return emit(TokenType::PUNC_DECLARATION, 2);
+            if (peek(1) == ':') return emit(TokenType::PUNC_SCOPE, 2);
+            break;
+        case '$': return emit(TokenType::PUNC_CALL, 1);
+        case '+': return emit(TokenType::PUNC_PLUS, 1);
+        case '*': return emit(TokenType::PUNC_MULT, 1);
+        case '/': {
+            if (peek(1) != '*') return emit(TokenType::PUNC_DIV, 1);
+            const auto end = data.data() + data.size();
+            const auto close = scan::findCommentEnd(data.data() + index + 2, end);
+            if (close == end)
+                throw exceptions::SyntaxError::unexpectedEOF(token.getPosition(), filename);
+            advanceTo(close + 2 - data.data());
+            token.end = index;
+            token.type = TokenType::COMMENT;
+            return true;
         }
-        incrementPosition(); // Advance past the ending quote
-        token.end = index;
-        return true;
-    }
-
-    // Match an identifier
-    if ( isalpha(currentByte) || currentByte == '_' ) {
-        token.type = TokenType::IDENTIFIER;
-        while ( !atEnd() ) {
-            auto const thisByte = rawData[index];
-            if ( !(isalnum(thisByte) || thisByte == '_') )
-                break;
-            incrementPosition();
+        case '%': return emit(TokenType::PUNC_MOD, 1);
+        case '.': return peek(1) == '?' ? emit(TokenType::PUNC_TRY_INDEX, 2) : emit(TokenType::PUNC_INDEX, 1);
+        case ',': return emit(TokenType::PUNC_COMMA, 1);
+        case '?': return emit(TokenType::PUNC_TERNARY, 1);
+        case '&': return peek(1) == '&' ? emit(TokenType::PUNC_AND, 2) : emit(TokenType::PUNC_AMPERSAND, 1);
+        case '|': return peek(1) == '|' ? emit(TokenType::PUNC_OR, 2) : emit(TokenType::PUNC_BITOR, 1);
+        case '=': return peek(1) == '=' ? emit(TokenType::PUNC_DOUBLE_EQ, 2) : emit(TokenType::PUNC_EQ, 1);
+        case '!': return peek(1) == '=' ? emit(TokenType::PUNC_NEQ, 2) : emit(TokenType::PUNC_NOT, 1);
+        case '^': return emit(TokenType::PUNC_XOR, 1);
+        case '<':
+            if (peek(1) == '=') return emit(TokenType::PUNC_LEQ, 2);
+            if (peek(1) == '<') return emit(TokenType::PUNC_SHL, 2);
+            return emit(TokenType::PUNC_LT, 1);
+        case '>':
+            if (peek(1) == '=') return emit(TokenType::PUNC_GEQ, 2);
+            if (peek(1) == '>') return emit(TokenType::PUNC_SHR, 2);
+            return emit(TokenType::PUNC_GT, 1);
+        case '[': return emit(TokenType::PUNC_L_BRACKET, 1);
+        case ']': return emit(TokenType::PUNC_R_BRACKET, 1);
+        case '{': return emit(TokenType::PUNC_L_BRACE, 1);
+        case '}': return emit(TokenType::PUNC_R_BRACE, 1);
+        case '(': return emit(TokenType::PUNC_L_PAREN, 1);
+        case ')': return emit(TokenType::PUNC_R_PAREN, 1);
+        case '-':
+            if (data.substr(index + 1, 3) == "inf" && !is(peek(4), scan::IDENT))
+                return emit(TokenType::KW_NEG_INFINITY, 4);
+            if (is(peek(1), scan::DIGIT)) {
+                number(token);
+                return true;
+            }
+            return emit(TokenType::PUNC_MINUS, 1);
+        case '"': {
+            // An escape always takes the character after it, even if that's a backslash or a quote
+            const auto end = data.data() + data.size();
+            auto cursor = data.data() + index + 1;
+            while (true) {
+                cursor = scan::findQuoteOrEscape(cursor, end);
+                if (cursor >= end) throw exceptions::SyntaxError::unexpectedEOF(token.getPosition(), filename);
+                if (*cursor == '"') break;
+                cursor += 2;
+            }
+            advanceTo(cursor + 1 - data.data());
+            token.end = index;
+            token.type = TokenType::LIT_STRING;
+            return true;
         }
-        token.end = index;
-        return true;
+        default:
+            if (is(current, scan::DIGIT)) {
+                number(token);
+                return true;
+            }
+            if (is(current, scan::IDENT_START)) {
+                identifier(token);
+                return true;
+            }
     }
 
     throw exceptions::SyntaxError(
         "unrecognized token", token.getPosition(), filename
     );
-}
\ No newline at end of file
+}
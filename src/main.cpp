@@ -1,20 +1,99 @@
+#include <chrono>
+#include <cstdlib>
 #include <filesystem>
 #include <iostream>
 #include <fstream>
 
+#include "cache.h"
+#include "counters.h"
 #include "lexer.h"
+#include "optimizer.h"
 #include "parsing.h"
+#include "profiler.h"
 #include "runtime.h"
+#include "source.h"
+
+/// @brief Parses a call depth limit or a thread count, which has to be a positive whole number.
+static bool parseCount(const std::string & text, size_t & out) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+    } catch (std::out_of_range & _) {
+        return false;
+    }
+    return out > 0;
+}
+
+/// How much CPU time goes by between samples under `--profile`.
+constexpr std::chrono::microseconds PROFILE_INTERVAL { 1000 };
+/// How many of the slowest functions and lines the profile summary lists.
+constexpr size_t PROFILE_ROWS = 20;
+
+/// @brief Stops the profiler, if it's running, writes out the stacks it sampled and summarizes them to stderr.
+static bool finishProfile(std::ofstream & file) {
+    if (!profiler::enabled) return true;
+    profiler::stop();
+    profiler::writeCollapsed(file);
+    file.flush();
+    if (!file) {
+        std::cerr << "filesystem error: failed to write profile" << std::endl;
+        return false;
+    }
+    profiler::printSummary(std::cerr, PROFILE_ROWS);
+    return true;
+}
 
 int main( int argc, char * argv[]) {
-    if (argc <= 1) {
-        std::cerr << "Usage: <filename> [args...]" << std::endl;
+    const auto start = std::chrono::steady_clock::now();
+    bool startupProfile = false;
+    bool count = false;
+    std::ofstream profileFile;
+    if (const auto depth = std::getenv("SHRIMPLY_MAX_DEPTH"); depth && !parseCount(depth, runtime::maxCallDepth)) {
+        std::cerr << "invalid SHRIMPLY_MAX_DEPTH: " << depth << " (expected a positive whole number)" << std::endl;
+        return 1;
+    }
+    // Flags come before the filename, everything after it is passed to the script
+    int fileIndex = 1;
+    for (; fileIndex < argc; fileIndex++) {
+        std::string flag { argv[fileIndex] };
+        if (flag.rfind("--", 0) != 0) break;
+        if (flag == "--tree-walk") runtime::useTreeWalker = true;
+        else if (flag == "--no-cache") cache::enabled = false;
+        else if (flag == "--no-fold") optimizer::enabled = false;
+        else if (flag == "--startup-profile") startupProfile = true;
+        else if (flag == "--count") count = true;
+        else if (flag == "--max-depth" || flag == "--jobs" || flag == "--profile") {
+            if (fileIndex + 1 >= argc) {
+                std::cerr << "missing value for " << flag << std::endl;
+                return 1;
+            }
+            const std::string value { argv[++fileIndex] };
+            if (flag == "--profile") {
+                // Opened now, so a bad path fails before the script runs instead of after
+                profileFile.open(value);
+                if (!profileFile) {
+                    std::cerr << "filesystem error: couldn't open profile for writing: " << value << std::endl;
+                    return 1;
+                }
+            } else if (!parseCount(value, flag == "--jobs" ? runtime::parseJobs : runtime::maxCallDepth)) {
+                std::cerr << "invalid " << flag << ": " << value << " (expected a positive whole number)" << std::endl;
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "unknown flag: " << flag << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc <= fileIndex) {
+        std::cerr << "Usage: [--tree-walk] [--no-cache] [--no-fold] [--startup-profile] [--count] [--max-depth N] [--jobs N] [--profile FILE] <filename | -> [args...]" << std::endl;
         return 0;
     }
 
     std::filesystem::path filename;
     try {
-        filename = std::filesystem::path(argv[1]);
+        filename = std::filesystem::path(argv[fileIndex]);
     } catch (std::exception& _) {
         std::cerr << "filesystem error: couldn't parse filename" << std::endl;
         return 1;
@@ -32,15 +111,23 @@ int main( int argc, char * argv[]) {
         nullptr,
         nullptr,
         0,
-        {}, {},
-        "<root>", {},
-        false
+        nullptr,
+        "<root>", {}
     };
 
     std::unordered_map<std::filesystem::path, std::shared_ptr<runtime::Module>> seen {};
     try {
-        auto module = initModule(filename, syntaxTree, rootFrame, seen);
+        // A script from standard input imports modules from the working directory, as if it were a file there
+        const auto modulePath = filename == source::STANDARD_INPUT
+            ? std::filesystem::current_path() / "<stdin>"
+            : filename;
+        runtime::parseImports(modulePath, syntaxTree);
+        auto module = initModule(modulePath, syntaxTree, rootFrame, seen);
         module->moduleName = "<root>";
+        if (startupProfile) {
+            runtime::startupProfile.total = std::chrono::steady_clock::now() - start;
+            runtime::startupProfile.print(std::cerr);
+        }
 
         if (module->functions.find("main") == module->functions.end()) {
             std::cerr << "no main function found" << std::endl;
@@ -54,18 +141,26 @@ int main( int argc, char * argv[]) {
             throw exceptions::RuntimeError(rootFrame, "main function must have exactly one argument");
         }
 
-        auto args = std::make_shared<std::vector<value::Value>>();
-        for (int i = 1; i < argc; i++) {
+        value::List args;
+        for (int i = fileIndex; i < argc; i++) {
             std::string arg { argv[i] };
-            args->emplace_back(arg);
+            args.emplace_back(arg);
         }
-        std::vector arglist { value::Value(args) };
+        std::vector arglist { value::Value(std::move(args)) };
 
+        if (profileFile.is_open() && !profiler::start(PROFILE_INTERVAL)) {
+            std::cerr << "couldn't start the profiler" << std::endl;
+            return 1;
+        }
+        if (count) counters::start(rootFrame);
         module->functions["main"]->call(rootFrame, arglist);
     } catch (const exceptions::RuntimeError & err) {
         std::cerr << err.what() << std::endl;
+        if (counters::enabled) counters::print(std::cerr);
+        finishProfile(profileFile);
         return -1;
     }
 
-    return 0;
+    if (counters::enabled) counters::print(std::cerr);
+    return finishProfile(profileFile) ? 0 : 1;
 }
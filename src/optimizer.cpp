@@ -0,0 +1,206 @@
+#include "optimizer.h"
+
+#include <memory>
+
+#include "runtime.h"
+
+using namespace parsing;
+using lexer::TokenType;
+using value::Value;
+
+bool optimizer::enabled = true;
+
+#define IF_DOWNCAST(type, name, ptr) if (auto name = dynamic_cast<type *>(ptr))
+
+namespace {
+    /// Folding `* "ab" 1000000` would build the whole string while loading the file, even if it never runs.
+    constexpr size_t STRING_LIMIT = 4096;
+
+    /// Evaluates operators on behalf of the folder. Nothing is ever reported against this frame,
+    /// since anything that raises is left to raise at runtime instead.
+    runtime::Stackframe foldFrame {
+        nullptr,
+        nullptr,
+        0,
+        nullptr,
+        "<fold>", {}
+    };
+
+    /// @brief Gets the value of an expression, if it's a literal.
+    bool literal(Expression * expr, Value & out) {
+        IF_DOWNCAST(Literal, lit, expr) {
+            out = lit->value;
+            return true;
+        }
+        return false;
+    }
+
+    /// @brief Gets the template of an expression, if it's a constant in any form.
+    bool constant(Expression * expr, Value & out) {
+        if (literal(expr, out)) return true;
+        IF_DOWNCAST(List, list, expr) {
+            out = list->constant;
+            return list->constant.getTag() == Value::ValueType::List;
+        }
+        IF_DOWNCAST(Map, map, expr) {
+            out = map->constant;
+            return map->constant.getTag() == Value::ValueType::Map;
+        }
+        return false;
+    }
+
+    class Folder {
+        /// The arena of the tree being folded, which the literals replacing folded expressions are made in.
+        Arena & arena;
+
+        Expression * makeLiteral(Value value, const exceptions::FilePosition & position) {
+            const auto lit = arena.make<Literal>(std::move(value));
+            lit->position = position;
+            return lit;
+        }
+    public:
+        explicit Folder(Arena & arena) : arena(arena) {}
+
+        void statement(Statement * stmt) {
+            IF_DOWNCAST(Block, block, stmt) {
+                for (const auto& child : block->statements)
+                    statement(child);
+            } else IF_DOWNCAST(ExpressionStatement, expr, stmt) {
+                expression(expr->expr);
+            } else IF_DOWNCAST(IfElse, ifelse, stmt) {
+                expression(ifelse->predicate);
+                if (ifelse->truePath) statement(ifelse->truePath);
+                if (ifelse->falsePath) statement(ifelse->falsePath);
+            } else IF_DOWNCAST(TryRecover, tryrecv, stmt) {
+                if (tryrecv->happyPath) statement(tryrecv->happyPath);
+                if (tryrecv->sadPath) statement(tryrecv->sadPath);
+            } else IF_DOWNCAST(Loop, loop, stmt) {
+                if (loop->body) statement(loop->body);
+            } else IF_DOWNCAST(Declaration, decl, stmt) {
+                expression(decl->value);
+            } else IF_DOWNCAST(Return, ret, stmt) {
+                expression(ret->value);
+            }
+        }
+
+        /// Folds an expression, replacing it if it turned out to be constant.
+        void expression(Expression *& expr) {
+            if (!expr) return;
+            IF_DOWNCAST(BinaryOp, bin, expr) {
+                if (bin->opr == TokenType::PUNC_EQ) {
+                    // The place keeps its shape, so it still names the same thing and fails the same way
+                    place(bin->lhs);
+                    expression(bin->rhs);
+                    return;
+                }
+                expression(bin->lhs);
+                expression(bin->rhs);
+                if (auto folded = binary(*bin)) expr = folded;
+            } else IF_DOWNCAST(UnaryOp, unary, expr) {
+                expression(unary->value);
+                if (Value operand; unary->opr == TokenType::PUNC_NOT && literal(unary->value, operand))
+                    expr = makeLiteral(Value(!operand.asBoolean()), unary->position);
+            } else IF_DOWNCAST(Ternary, tern, expr) {
+                expression(tern->predicate);
+                expression(tern->lhs);
+                expression(tern->rhs);
+                if (Value pred; literal(tern->predicate, pred))
+                    expr = pred.asBoolean() ? tern->lhs : tern->rhs;
+            } else IF_DOWNCAST(Call, call, expr) {
+                for (auto& arg : call->arguments)
+                    expression(arg);
+            } else IF_DOWNCAST(List, list, expr) {
+                value::List members;
+                members.reserve(list->members.size());
+                auto isConstant = true;
+                for (auto& member : list->members) {
+                    expression(member);
+                    Value value;
+                    if (isConstant && constant(member, value)) members.push_back(std::move(value));
+                    else isConstant = false;
+                }
+                if (isConstant) list->constant = Value(std::move(members));
+            } else IF_DOWNCAST(Map, map, expr) {
+                value::Map pairs;
+                pairs.reserve(map->pairs.size());
+                auto isConstant = true;
+                for (auto& pair : map->pairs) {
+                    expression(pair.second);
+                    Value value;
+                    if (isConstant && constant(pair.second, value)) pairs.emplace(pair.first, std::move(value));
+                    else isConstant = false;
+                }
+                if (isConstant) map->constant = Value(std::move(pairs));
+            }
+        }
+
+        /// Folds the insides of an assignment target without replacing the target itself.
+        void place(Expression *& expr) {
+            IF_DOWNCAST(BinaryOp, bin, expr) {
+                expression(bin->lhs);
+                expression(bin->rhs);
+            } else IF_DOWNCAST(Ternary, tern, expr) {
+                expression(tern->predicate);
+                place(tern->lhs);
+                place(tern->rhs);
+            }
+        }
+
+        /// @return What a binary operator folds to, or nothing if it can't be folded.
+        Expression * binary(const BinaryOp & bin) {
+            Value left, right;
+            if (!literal(bin.lhs, left)) return nullptr;
+            switch (bin.opr.inner()) {
+                case TokenType::PUNC_AND:
+                case TokenType::PUNC_OR: {
+                    const auto lhs = left.asBoolean();
+                    // The right hand side is never evaluated if the left hand side decides the result
+                    if (lhs == (bin.opr == TokenType::PUNC_OR)) return makeLiteral(Value(lhs), bin.position);
+                    if (!literal(bin.rhs, right)) return nullptr;
+                    return makeLiteral(Value(right.asBoolean()), bin.position);
+                }
+                case TokenType::PUNC_INDEX:
+                case TokenType::PUNC_TRY_INDEX: {
+                    if (!literal(bin.rhs, right)) return nullptr;
+                    try {
+                        Value found;
+                        if (runtime::tryIndex(foldFrame, left, right, found))
+                            return makeLiteral(std::move(found), bin.position);
+                        if (bin.opr == TokenType::PUNC_TRY_INDEX)
+                            return makeLiteral(Value(), bin.position);
+                    } catch (const exceptions::RuntimeError &) {}
+                    return nullptr;
+                }
+                case TokenType::PUNC_MULT: {
+                    if (!literal(bin.rhs, right)) return nullptr;
+                    int64_t count;
+                    if (
+                        left.getTag() == Value::ValueType::String && right.asInteger(count) && count > 0 &&
+                        // Dividing, since the product can wrap around
+                        !left.string->empty() && (uint64_t) count > STRING_LIMIT / left.string->size()
+                    ) return nullptr;
+                    break;
+                }
+                default:
+                    if (!literal(bin.rhs, right)) return nullptr;
+            }
+            try {
+                return makeLiteral(runtime::binaryOperation(foldFrame, bin.opr.inner(), left, right), bin.position);
+            } catch (const exceptions::RuntimeError &) {
+                return nullptr;
+            }
+        }
+    };
+}
+
+void optimizer::fold(Root & root) {
+    if (!enabled) return;
+    Folder folder { *root.arena };
+    for (const auto& item : root.items) {
+        IF_DOWNCAST(Function, fn, item) {
+            if (fn->body) folder.statement(fn->body);
+        } else IF_DOWNCAST(Declaration, decl, item) {
+            folder.expression(decl->value);
+        }
+    }
+}
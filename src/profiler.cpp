@@ -0,0 +1,151 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <signal.h>
+#include <time.h>
+
+#include "runtime.h"
+
+bool profiler::enabled = false;
+std::atomic<uint32_t> profiler::pending { 0 };
+
+namespace {
+    /// Only the innermost frames of a stack deeper than this are recorded, under a frame marking where it was cut.
+    /// Deep recursion would otherwise make every sample cost as much as the whole stack.
+    constexpr size_t MAX_FRAMES = 512;
+
+    std::chrono::microseconds tickLength {};
+    uint64_t ticks = 0;
+    timer_t timer {};
+
+    struct Time {
+        uint64_t self = 0;
+        uint64_t total = 0;
+    };
+
+    /// Ticks for each distinct stack, already in collapsed form.
+    std::unordered_map<std::string, uint64_t> stacks {};
+    std::unordered_map<std::string, Time> functions {};
+    std::unordered_map<std::string, Time> lines {};
+
+    /// CPU time is only checked on the scheduler's clock, which can be coarser than the interval, so a single signal
+    /// stands for every interval that went by since the last one.
+    void tick(int, siginfo_t * info, void *) {
+        profiler::pending.fetch_add(1 + std::max(info->si_overrun, 0), std::memory_order_relaxed);
+    }
+
+    void printTimes(
+        std::ostream & stream, const char * heading, const std::unordered_map<std::string, Time> & times, const size_t rows
+    ) {
+        std::vector<const std::pair<const std::string, Time> *> sorted {};
+        sorted.reserve(times.size());
+        for (const auto& entry : times)
+            sorted.push_back(&entry);
+        std::sort(sorted.begin(), sorted.end(), [](const auto left, const auto right) {
+            if (left->second.self != right->second.self) return left->second.self > right->second.self;
+            if (left->second.total != right->second.total) return left->second.total > right->second.total;
+            return left->first < right->first;
+        });
+        if (sorted.size() > rows) sorted.resize(rows);
+
+        const auto ms = [](const uint64_t count) { return std::chrono::duration<double, std::milli>(tickLength * count).count(); };
+        const auto percent = [](const uint64_t count) { return ticks ? 100.0 * count / ticks : 0.0; };
+        stream << "    " << heading << ":" << std::endl
+            << "        " << std::setw(12) << "self ms" << std::setw(8) << "%"
+            << std::setw(12) << "total ms" << std::setw(8) << "%" << std::endl;
+        for (const auto entry : sorted) {
+            const auto& [name, time] = *entry;
+            stream << "        " << std::fixed << std::setprecision(1)
+                << std::setw(12) << ms(time.self) << std::setw(8) << percent(time.self)
+                << std::setw(12) << ms(time.total) << std::setw(8) << percent(time.total)
+                << "  " << name << std::endl;
+        }
+        stream.unsetf(std::ios::floatfield);
+    }
+}
+
+bool profiler::start(const std::chrono::microseconds interval) {
+    tickLength = interval;
+    struct sigaction action {};
+    action.sa_sigaction = tick;
+    sigemptyset(&action.sa_mask);
+    // Reading from standard input shouldn't fail just because a tick came in the middle of it
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+    sigevent event {};
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGPROF;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &timer) != 0) return false;
+    itimerspec spec {};
+    spec.it_interval.tv_sec = interval.count() / 1000000;
+    spec.it_interval.tv_nsec = interval.count() % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(timer, 0, &spec, nullptr) != 0) {
+        timer_delete(timer);
+        return false;
+    }
+    enabled = true;
+    return true;
+}
+
+void profiler::stop() {
+    if (enabled) timer_delete(timer);
+}
+
+void profiler::sample(const runtime::Stackframe & frame) {
+    const uint64_t count = pending.exchange(0, std::memory_order_relaxed);
+    if (!count) return;
+    ticks += count;
+
+    // The root frame isn't a call, so the stack stops short of it
+    std::vector<const runtime::Stackframe *> chain {};
+    for (auto current = &frame; current->parent && chain.size() < MAX_FRAMES; current = current->parent)
+        chain.push_back(current);
+    const auto truncated = chain.size() == MAX_FRAMES && chain.back()->parent && chain.back()->parent->parent;
+
+    std::string stack = truncated ? "[truncated]" : "";
+    // Recursive calls only count once towards the total time of a function or line
+    std::unordered_set<std::string> seenFunctions {}, seenLines {};
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+        const auto& current = **it;
+        auto function = current.root ? current.root->moduleName.str() : std::string();
+        function += "::";
+        function += current.functionName;
+        auto line = current.root ? current.root->moduleName.str() : std::string();
+        line += ":" + std::to_string(current.sourcePos.line);
+
+        if (!stack.empty()) stack += ';';
+        stack += std::string(current.functionName) + " (" + line + ")";
+        if (seenFunctions.insert(function).second) functions[function].total += count;
+        if (seenLines.insert(line).second) lines[line].total += count;
+        if (it + 1 == chain.rend()) {
+            functions[function].self += count;
+            lines[line].self += count;
+        }
+    }
+    if (!stack.empty()) stacks[stack] += count;
+}
+
+void profiler::writeCollapsed(std::ostream & stream) {
+    std::vector<const std::pair<const std::string, uint64_t> *> sorted {};
+    sorted.reserve(stacks.size());
+    for (const auto& entry : stacks)
+        sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](const auto left, const auto right) { return left->first < right->first; });
+    for (const auto entry : sorted)
+        stream << entry->first << " " << entry->second << "\n";
+}
+
+void profiler::printSummary(std::ostream & stream, const size_t rows) {
+    stream << "profile: " << ticks << " samples, "
+        << std::chrono::duration<double, std::milli>(tickLength * ticks).count() << " ms" << std::endl;
+    printTimes(stream, "functions", functions, rows);
+    printTimes(stream, "lines", lines, rows);
+}
@@ -0,0 +1,142 @@
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "runtime.h"
+
+using namespace parsing;
+
+#define IF_DOWNCAST(type, name, ptr) if (auto name = dynamic_cast<type *>(ptr))
+
+namespace {
+    /// Walks a function body, handing out local slots as declarations come into scope.
+    class Resolver {
+        runtime::SyntaxFunction & function;
+        /// Names declared in each lexical scope, innermost last.
+        std::vector<std::unordered_map<intern::Symbol, uint32_t>> scopes {};
+        /// The first free slot of each scope, so sibling scopes can reuse slots.
+        std::vector<uint32_t> scopeBases {};
+        uint32_t nextSlot = 0;
+        /// How many try blocks the current statement is inside of.
+        uint32_t tryDepth = 0;
+
+    public:
+        explicit Resolver(runtime::SyntaxFunction & function) : function(function) {}
+
+        void beginScope() {
+            scopes.emplace_back();
+            scopeBases.push_back(nextSlot);
+        }
+
+        void endScope() {
+            scopes.pop_back();
+            nextSlot = scopeBases.back();
+            scopeBases.pop_back();
+        }
+
+        /// Declares a name in the innermost scope, reusing its slot if it was already declared there.
+        uint32_t declare(const intern::Symbol name) {
+            auto & scope = scopes.back();
+            auto it = scope.find(name);
+            if (it != scope.end()) return it->second;
+            auto slot = nextSlot++;
+            if (nextSlot > function.localCount) function.localCount = nextSlot;
+            scope[name] = slot;
+            return slot;
+        }
+
+        void bind(Path & path) const {
+            path.binding = Binding::GLOBAL;
+            if (path.members.size() != 1) return;
+            for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+                auto found = it->find(path.members.front());
+                if (found != it->end()) {
+                    path.binding = Binding::LOCAL;
+                    path.slot = found->second;
+                    return;
+                }
+            }
+        }
+
+        void scopedStatement(Statement * stmt) {
+            if (!stmt) return;
+            beginScope();
+            statement(stmt);
+            endScope();
+        }
+
+        void statement(Statement * stmt) {
+            IF_DOWNCAST(Block, block, stmt) {
+                beginScope();
+                for (const auto& child : block->statements)
+                    statement(child);
+                endScope();
+            } else IF_DOWNCAST(ExpressionStatement, expr, stmt) {
+                expression(expr->expr);
+            } else IF_DOWNCAST(IfElse, ifelse, stmt) {
+                expression(ifelse->predicate);
+                scopedStatement(ifelse->truePath);
+                scopedStatement(ifelse->falsePath);
+            } else IF_DOWNCAST(TryRecover, tryrecv, stmt) {
+                tryDepth++;
+                scopedStatement(tryrecv->happyPath);
+                tryDepth--;
+                if (tryrecv->binding.members.empty()) return;
+                beginScope();
+                if (tryrecv->binding.members.size() == 1) {
+                    tryrecv->binding.binding = Binding::LOCAL;
+                    tryrecv->binding.slot = declare(tryrecv->binding.members.front());
+                } else bind(tryrecv->binding);
+                statement(tryrecv->sadPath);
+                endScope();
+            } else IF_DOWNCAST(Loop, loop, stmt) {
+                scopedStatement(loop->body);
+            } else IF_DOWNCAST(Declaration, decl, stmt) {
+                // The value is evaluated before the name is visible, so `:= x + x 1` can refer to an outer x
+                expression(decl->value);
+                decl->slot = declare(decl->name);
+            } else IF_DOWNCAST(Return, ret, stmt) {
+                expression(ret->value);
+                ret->tailCall = tryDepth == 0 && dynamic_cast<Call *>(ret->value);
+            }
+        }
+
+        void expression(Expression * expr) {
+            IF_DOWNCAST(Path, path, expr) {
+                bind(*path);
+            } else IF_DOWNCAST(BinaryOp, bin, expr) {
+                expression(bin->lhs);
+                expression(bin->rhs);
+            } else IF_DOWNCAST(UnaryOp, unary, expr) {
+                expression(unary->value);
+            } else IF_DOWNCAST(Ternary, tern, expr) {
+                expression(tern->predicate);
+                expression(tern->lhs);
+                expression(tern->rhs);
+            } else IF_DOWNCAST(Call, call, expr) {
+                for (const auto& arg : call->arguments)
+                    expression(arg);
+            } else IF_DOWNCAST(List, list, expr) {
+                for (const auto& member : list->members)
+                    expression(member);
+            } else IF_DOWNCAST(Map, map, expr) {
+                for (const auto& pair : map->pairs)
+                    expression(pair.second);
+            }
+        }
+    };
+}
+
+void runtime::resolve(SyntaxFunction & function) {
+    Resolver resolver { function };
+    function.localCount = 0;
+    function.argumentSlots.clear();
+
+    resolver.beginScope();
+    for (const auto& arg : function.argumentNames)
+        function.argumentSlots.push_back(resolver.declare(arg));
+    function.argcSlot = resolver.declare("__ARGC");
+    for (const auto& stmt : function.body)
+        resolver.statement(stmt);
+    resolver.endScope();
+}
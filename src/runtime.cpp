@@ -1,6 +1,5 @@
-/// This is the stackframe depth limit. Adjust if you're running into errors.
-#define DEPTH_LIMIT 1024
-
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -8,21 +7,40 @@
 #include <filesystem>
 #include <cmath>
 #include <list>
+#include <unordered_set>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <sys/resource.h>
 
 #include "runtime.h"
 
 #include <fstream>
 #include <iostream>
 
+#include "bytecode.h"
+#include "cache.h"
+#include "counters.h"
+#include "optimizer.h"
 #include "parsing.h"
+#include "profiler.h"
+#include "source.h"
 #include "value.h"
 
 using namespace runtime;
 using exceptions::RuntimeError;
+
+bool runtime::useTreeWalker = false;
+size_t runtime::maxCallDepth = 100000;
+size_t runtime::parseJobs = std::max(std::thread::hardware_concurrency(), 1u);
+StartupProfile runtime::startupProfile {};
 using lexer::TokenType;
 using value::Value;
 
 Value parsing::Ternary::result(Stackframe &frame) {
+    counters::count(&counters::Counts::expressions);
     frame.sourcePos = position;
     auto pred = predicate->result(frame);
     if (pred.asBoolean())
@@ -30,56 +48,60 @@ Value parsing::Ternary::result(Stackframe &frame) {
     return rhs->result(frame);
 }
 
-Value * parsing::Ternary::pointer(Stackframe &frame) {
+void parsing::Ternary::assign(Stackframe &frame, Expression &value) {
     frame.sourcePos = position;
     auto pred = predicate->result(frame);
     if (pred.asBoolean())
-        return lhs->pointer(frame);
-    return rhs->pointer(frame);
+        return lhs->assign(frame, value);
+    rhs->assign(frame, value);
 }
 
 
 Value parsing::BinaryOp::result(Stackframe & frame) {
+    counters::count(&counters::Counts::expressions);
     frame.sourcePos = position;
     switch (opr.inner()) {
         case TokenType::PUNC_INDEX: {
             auto left = lhs->result(frame);
             frame.sourcePos = rhs->position;
-            if ( left.getTag() == Value::ValueType::String ) {
-                auto str = left.asString();
-                int64_t right;
-                auto r = rhs->result(frame);
-                if (!r.asInteger(right)) throw RuntimeError(frame, "cannot index string using " + r.raw_string());
-                if (right < 0 || right >= str.size()) throw RuntimeError(frame, "string index is out of bounds: " + std::to_string(right));
-                return Value(std::string(1, str.c_str()[right]));
-            }
-            if ( std::shared_ptr<std::vector<Value>> list {}; left.asList(list) ) {
-                int64_t right;
-                auto r = rhs->result(frame);
-                if (!r.asInteger(right)) throw RuntimeError(frame, "cannot index list using " + r.raw_string());
-                if (right < 0 || right >= list->size()) throw RuntimeError(frame, "list index is out of bounds: " + std::to_string(right));
-                return list->at(right);
-            }
-            if ( std::shared_ptr<std::unordered_map<std::string, Value>> map {}; lhs->result(frame).asMap(map) ) {
-                auto index = rhs->result(frame);
-                auto access = index.asString();
-                auto iter = map->find(access);
-                if (iter == map->end()) throw RuntimeError(frame, "index does not exist in map: " + index.raw_string());
-                return iter->second;
-            }
-            throw RuntimeError(frame, "cannot index into value " + left.raw_string());
+            auto index = rhs->result(frame);
+            return indexValue(frame, left, index);
+        }
+        case TokenType::PUNC_TRY_INDEX: {
+            auto left = lhs->result(frame);
+            frame.sourcePos = rhs->position;
+            auto index = rhs->result(frame);
+            Value found;
+            tryIndex(frame, left, index, found);
+            return found;
         }
         case TokenType::PUNC_EQ: {
             // Assignment
-            auto ptr = lhs->pointer(frame);
-            frame.sourcePos = rhs->position;
-            *ptr = rhs->result(frame);
+            lhs->assign(frame, *rhs);
             return Value {};
         }
-        case TokenType::PUNC_PLUS: {
+#define LOG(type, opr, inverse) \
+        case TokenType::type: { \
+            auto left = lhs->result(frame).asBoolean(); \
+            if (inverse left) return Value(left); \
+            frame.sourcePos = rhs->position; \
+            auto right = rhs->result(frame).asBoolean(); \
+            return Value(left opr right); \
+        }
+        LOG(PUNC_AND, &&, !);
+        LOG(PUNC_OR, ||, );
+        default: {
             auto left = lhs->result(frame);
             frame.sourcePos = rhs->position;
             auto right = rhs->result(frame);
+            return binaryOperation(frame, opr.inner(), left, right);
+        }
+    }
+}
+
+Value runtime::binaryOperation(Stackframe &frame, TokenType::Value opr, const Value &left, const Value &right) {
+    switch (opr) {
+        case TokenType::PUNC_PLUS: {
             if (left.getTag() == Value::ValueType::String || right.getTag() == Value::ValueType::String)
                 return Value(left.asString() + right.asString());
             if (left.getTag() == Value::ValueType::Integer && right.getTag() == Value::ValueType::Integer)
@@ -89,9 +111,6 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
             throw RuntimeError(frame, "cannot add values " + left.raw_string() + " and " + right.raw_string());
         }
         case TokenType::PUNC_MINUS: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            auto right = rhs->result(frame);
             if (left.getTag() == Value::ValueType::Integer && right.getTag() == Value::ValueType::Integer)
                 return Value(left.integer - right.integer);
             if (double x, y; left.asNumber(x) && right.asNumber(y))
@@ -99,16 +118,15 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
             throw RuntimeError(frame, "cannot subtract values " + left.raw_string() + " and " + right.raw_string());
         }
         case TokenType::PUNC_MULT: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            auto right = rhs->result(frame);
             if (
                 int64_t count;
                 left.getTag() == Value::ValueType::String && right.asInteger(count)
             ) {
+                // Repeating nothing is nothing, however many times it's done
+                if (left.string->empty()) return left;
                 std::ostringstream ss;
-                for (auto i = 0; i < count; i++) {
-                    ss << left.string;
+                for (int64_t i = 0; i < count; i++) {
+                    ss << *left.string;
                 }
                 return Value(ss.str());
             }
@@ -120,40 +138,28 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
         }
         case TokenType::PUNC_DIV:
         case TokenType::PUNC_MOD: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            auto right = rhs->result(frame);
             if (left.getTag() == Value::ValueType::Integer && right.getTag() == Value::ValueType::Integer) {
                 if (right.integer == 0) throw RuntimeError(frame, "integer division by zero");
                 return Value(
-                    opr.inner() == TokenType::PUNC_DIV
+                    opr == TokenType::PUNC_DIV
                     ? left.integer / right.integer
                     : left.integer % right.integer
                 );
             }
             if (double x, y; left.asNumber(x) && right.asNumber(y))
                 return Value(
-                    opr.inner() == TokenType::PUNC_DIV
+                    opr == TokenType::PUNC_DIV
                     ? x / y
                     : std::fmod(x, y)
                 );
             throw RuntimeError(frame, "cannot divide values " + left.raw_string() + " and " + right.raw_string());
         }
-        case TokenType::PUNC_DOUBLE_EQ: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            return Value(left == rhs->result(frame));
-        }
-        case TokenType::PUNC_NEQ: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            return Value(!(left == rhs->result(frame)));
-        }
+        case TokenType::PUNC_DOUBLE_EQ:
+            return Value(left == right);
+        case TokenType::PUNC_NEQ:
+            return Value(!(left == right));
 #define CMP(type, opr) \
         case TokenType::type: { \
-            auto left = lhs->result(frame); \
-            frame.sourcePos = rhs->position; \
-            auto right = rhs->result(frame); \
             double x, y;  \
             if (!(left.asNumber(x) && right.asNumber(y))) return Value(left.to_string() opr right.to_string()); \
             return Value(x opr y); \
@@ -164,9 +170,6 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
         CMP(PUNC_GEQ, >=);
 #define BIT(type, opr, name) \
         case TokenType::type: { \
-            auto left = lhs->result(frame); \
-            frame.sourcePos = rhs->position; \
-            auto right = rhs->result(frame); \
             int64_t x, y;  \
             if (!(left.asInteger(x) && right.asInteger(y))) throw RuntimeError(frame, \
                 "cannot apply bitwise " name " to values " + \
@@ -179,9 +182,6 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
         BIT(PUNC_SHL, <<, "left shift");
         BIT(PUNC_SHR, >>, "right shift");
         case TokenType::PUNC_XOR: {
-            auto left = lhs->result(frame);
-            frame.sourcePos = rhs->position;
-            auto right = rhs->result(frame);
             if (left.tag == Value::ValueType::Boolean && right.tag == Value::ValueType::Boolean)
                 return Value(left.boolean != right.boolean);
             int64_t x, y;
@@ -189,24 +189,16 @@ Value parsing::BinaryOp::result(Stackframe & frame) {
                 return Value(left.integer ^ right.integer);
             throw RuntimeError(frame, "cannot apply binary xor to values " + left.raw_string() + " and " + right.raw_string() );
         }
-#define LOG(type, opr, inverse) \
-        case TokenType::type: { \
-            auto left = lhs->result(frame).asBoolean(); \
-            if (inverse left) return Value(left); \
-            frame.sourcePos = rhs->position; \
-            auto right = rhs->result(frame).asBoolean(); \
-            return Value(left opr right); \
-        }
-        LOG(PUNC_AND, &&, !);
-        LOG(PUNC_OR, ||, );
         default:
             throw RuntimeError(
                 frame,
-                "internal error: BinaryOp opr was not a valid operand: " + opr.to_string()
+                "internal error: BinaryOp opr was not a valid operand: " + TokenType(opr).to_string()
             );
     }
 }
+
 Value parsing::UnaryOp::result(Stackframe & frame) {
+    counters::count(&counters::Counts::expressions);
     frame.sourcePos = position;
     switch (opr.inner()) {
         case TokenType::PUNC_NOT:
@@ -219,97 +211,150 @@ Value parsing::UnaryOp::result(Stackframe & frame) {
     }
 }
 
-Value parsing::Call::result(Stackframe & frame) {
-    frame.sourcePos = position;
-
-    auto fn = frame.root->getFunction(frame, functionPath);
-
+/// Evaluates the arguments of a call, in order.
+static std::vector<Value> evaluateArguments(Stackframe & frame, const parsing::Call & call) {
     std::vector<Value> args {};
-    args.reserve(arguments.size());
-    for (const auto& arg : arguments) {
+    args.reserve(call.arguments.size());
+    for (const auto& arg : call.arguments) {
         frame.sourcePos = arg->position;
         args.push_back(arg->result(frame));
     }
+    return args;
+}
+
+Value parsing::Call::result(Stackframe & frame) {
+    counters::count(&counters::Counts::expressions);
+    frame.sourcePos = position;
+
+    auto& fn = frame.root->resolveCall(frame, functionPath);
+    auto args = evaluateArguments(frame, *this);
 
-    return fn->call(frame, args);
+    if (counters::enabled) counters::native(fn, functionPath);
+    return fn.call(frame, args);
 }
 
-Value *parsing::BinaryOp::pointer(Stackframe &frame) {
+void parsing::BinaryOp::assign(Stackframe &frame, Expression &value) {
     frame.sourcePos = position;
+    if (opr == TokenType::PUNC_INDEX) {
+        // Same order as the virtual machine: container, index, then the value
+        auto container = lhs->result(frame);
+        frame.sourcePos = rhs->position;
+        auto index = rhs->result(frame);
+        frame.sourcePos = value.position;
+        auto result = value.result(frame);
+        frame.sourcePos = position;
+        if (assignIndex(frame, container, index, result)) return;
+    }
+    throw RuntimeError(frame, "expression does not support assignment: " + lhs->to_string());
+}
 
-    if (opr != TokenType::PUNC_INDEX) goto error;
-    {
-        auto target = lhs->result(frame);
-        if (
-            std::shared_ptr<std::vector<Value>> list;
-            target.asList(list)
-        ) {
-            frame.sourcePos = rhs->position;
-            auto left = lhs->result(frame);
-            auto index = rhs->result(frame);
-            int64_t num;
-            if (!index.asInteger(num))
-                throw RuntimeError(frame, "cannot index list using " + index.raw_string());
-            if (num < 0 || num >= list->size())
-                throw RuntimeError(frame, "list index is out of bounds: " + std::to_string(num));
-            return &list->at(num);
-        }
-        if (
-            std::shared_ptr<std::unordered_map<std::string, Value>> map;
-            target.asMap(map)
-        ) {
-            frame.sourcePos = rhs->position;
-            auto index = rhs->result(frame);
-            auto access = index.asString();
-            if (map->find(access) == map->end()) {
-                map->operator[](access) = Value();
-            }
-            return &map->at(access);
-        }
+bool runtime::tryIndex(Stackframe &frame, const Value &container, const Value &index, Value &out) {
+    if ( container.getTag() == Value::ValueType::String ) {
+        int64_t num;
+        if (!index.asInteger(num)) throw RuntimeError(frame, "cannot index string using " + index.raw_string());
+        if (num < 0 || static_cast<size_t>(num) >= container.string->size()) return false;
+        out = Value(std::string(1, (*container.string)[num]));
+        return true;
+    }
+    if ( container.getTag() == Value::ValueType::List ) {
+        int64_t num;
+        if (!index.asInteger(num)) throw RuntimeError(frame, "cannot index list using " + index.raw_string());
+        if (num < 0 || static_cast<size_t>(num) >= container.list->size()) return false;
+        out = (*container.list)[num];
+        return true;
+    }
+    if ( container.getTag() == Value::ValueType::Map ) {
+        intern::Symbol key;
+        if (!index.asKey(key, false)) return false;
+        auto iter = container.map->find(key);
+        if (iter == container.map->end()) return false;
+        out = iter->second;
+        return true;
     }
+    throw RuntimeError(frame, "cannot index into value " + container.raw_string());
+}
 
-    error:
-    throw RuntimeError(frame, "expression does not support assignment: " + lhs->to_string());
+Value runtime::indexValue(Stackframe &frame, const Value &container, const Value &index) {
+    Value out;
+    if (tryIndex(frame, container, index, out)) return out;
+    if ( container.getTag() == Value::ValueType::Map )
+        throw RuntimeError(frame, "index does not exist in map: " + index.raw_string());
+    int64_t num;
+    index.asInteger(num);
+    throw RuntimeError(
+        frame,
+        std::string(container.getTag() == Value::ValueType::String ? "string" : "list") +
+        " index is out of bounds: " + std::to_string(num)
+    );
+}
+
+bool runtime::assignIndex(Stackframe &frame, const Value &container, const Value &index, const Value &value) {
+    if ( container.getTag() == Value::ValueType::List ) {
+        int64_t num;
+        if (!index.asInteger(num))
+            throw RuntimeError(frame, "cannot index list using " + index.raw_string());
+        if (num < 0 || static_cast<size_t>(num) >= container.list->size())
+            throw RuntimeError(frame, "list index is out of bounds: " + std::to_string(num));
+        container.list->at(num) = value;
+        return true;
+    }
+    if ( container.getTag() == Value::ValueType::Map ) {
+        intern::Symbol key;
+        index.asKey(key, true);
+        container.map->operator[](key) = value;
+        return true;
+    }
+    return false;
 }
 
 Value parsing::Path::result(Stackframe &frame) {
+    counters::count(&counters::Counts::expressions);
     return *pointer(frame);
 }
 
+void parsing::Expression::assign(Stackframe &frame, Expression &value) {
+    auto place = pointer(frame);
+    frame.sourcePos = value.position;
+    *place = value.result(frame);
+}
+
 Value* parsing::Path::pointer(Stackframe &frame) {
     return frame.getVariable(*this);
 }
 
 Value * Stackframe::getVariable(const parsing::Path &path) {
+    switch (path.binding) {
+        case parsing::Binding::LOCAL:
+            return &locals[path.slot];
+        case parsing::Binding::GLOBAL:
+            if (!path.global) path.global = getGlobal(path);
+            return path.global;
+        default:
+            return getGlobal(path);
+    }
+}
+
+Value * Stackframe::getGlobal(const parsing::Path &path) {
     if (path.members.empty())
         throw RuntimeError(*this, "internal error: tried to resolve variable with empty path");
     if (path.members.size() == 1) {
-        // This is a lone identifier, which names variable in local scope
         const auto& name = path.members.back();
-        auto current = this;
-        while (current) {
-            auto it = current->variables.find(name);
-            if (it != current->variables.end()) return &it->second;
-            if (current->boundary) break;
-            current = current->parent;
-        };
-        // Check globals
         auto it = root->globals.find(name);
         if (it != root->globals.end()) return &it->second;
         throw RuntimeError(
             *this,
-            "could not find variable \"" + name +  "\" in scope"
+            "could not find variable \"" + name.str() +  "\" in scope"
         );
     }
 
     // This is a scoped identifier, look for imported modules
     {
-        std::shared_ptr<Module> current = root;
+        Module * current = root;
         auto iter = path.members.cbegin();
         while (iter != path.members.cend() - 1) {
             auto it = current->imported.find(*iter);
             if (it == current->imported.end()) goto error;
-            current = it->second;
+            current = it->second.get();
             ++iter;
         }
         auto it = current->globals.find(path.members.back());
@@ -319,7 +364,7 @@ Value * Stackframe::getVariable(const parsing::Path &path) {
     throw RuntimeError(*this, "could not resolve variable path: " + path.to_string());
 }
 
-std::shared_ptr<AbstractFunction> Module::getFunction(Stackframe & frame, parsing::Path &path) {
+std::shared_ptr<AbstractFunction> Module::getFunction(Stackframe & frame, const parsing::Path &path) {
     auto mod = this;
     for (auto it = path.members.begin(); it != (path.members.end() - 1); ++it) {
         auto found = mod->imported.find(*it);
@@ -333,77 +378,136 @@ std::shared_ptr<AbstractFunction> Module::getFunction(Stackframe & frame, parsin
     return fn->second;
 }
 
+uint64_t Module::callEpoch = 1;
 
-void Stackframe::assignVariable(const parsing::Path &path, const Value &value) {
-    if (path.members.size() == 1)
-        variables[path.members.back()] = value;
-    else
-        *getVariable(path) = value;
+AbstractFunction & Module::resolveCall(Stackframe & frame, const parsing::Path &path) {
+    if (path.function && path.functionEpoch == callEpoch) return *path.function;
+    path.function = getFunction(frame, path).get();
+    path.functionEpoch = callEpoch;
+    return *path.function;
+}
+
+
+Value * LocalStack::push(const size_t count, Mark & mark) {
+    mark = { segment, top };
+    if (segments.empty() || top + count > segmentSizes[segment]) {
+        // Doesn't fit, so move on to the next segment
+        if (!segments.empty()) segment++;
+        top = 0;
+        if (segment == segments.size() || segmentSizes[segment] < count) {
+            auto size = std::max(count, SEGMENT_SIZE);
+            segments.resize(segment);
+            segmentSizes.resize(segment);
+            segments.push_back(std::make_unique<Value[]>(size));
+            segmentSizes.push_back(size);
+        }
+    }
+    auto slots = &segments[segment][top];
+    top += count;
+    return slots;
 }
 
+void LocalStack::release(const Mark mark) {
+    // Releases happen in the opposite order of pushes, so there's at most one segment boundary to go back over
+    const auto start = segment == mark.segment ? mark.top : 0;
+    for (auto i = start; i < top; i++)
+        segments[segment][i] = Value();
+    segment = mark.segment;
+    top = mark.top;
+}
+
+LocalStack runtime::localStack;
+
+/// Gives a call's slots back to the local stack, however the call exits.
+struct LocalsGuard {
+    LocalStack::Mark mark;
+    ~LocalsGuard() { localStack.release(mark); }
+};
+
 Stackframe Stackframe::branch(exceptions::FilePosition pos) {
-    if (depth > DEPTH_LIMIT)
+    if (depth >= maxCallDepth)
         throw exceptions::RuntimeError(*this, "reached call depth limit" );
-    auto child = *this;
-    child.boundary = false;
+    Stackframe child = *this;
     child.depth += 1;
     child.parent = this;
-    child.variables = {};
     child.sourcePos = pos;
     return child;
 }
 
 
 Value parsing::List::result(Stackframe &frame) {
+    counters::count(&counters::Counts::expressions);
     frame.sourcePos = position;
-    auto vec = std::make_shared<std::vector<Value>>();
-    vec->reserve(members.size());
+    if (constant.getTag() == Value::ValueType::List) return constant.deepCopy();
+    value::List vec;
+    vec.reserve(members.size());
     for (const auto& expr : members) {
         frame.sourcePos = expr->position;
-        vec->push_back(expr->result(frame));
+        vec.push_back(expr->result(frame));
     }
-    return Value(vec);
+    return Value(std::move(vec));
 }
 
 Value parsing::Map::result(Stackframe &frame) {
+    counters::count(&counters::Counts::expressions);
     frame.sourcePos = position;
-    auto map = std::make_shared<std::unordered_map<std::string, Value>>();
-    map->reserve(pairs.size());
+    if (constant.getTag() == Value::ValueType::Map) return constant.deepCopy();
+    value::Map map;
+    map.reserve(pairs.size());
     for (const auto & pair : pairs) {
-        map->operator[](pair.first) = pair.second->result(frame);
+        map[pair.first] = pair.second->result(frame);
     }
-    return Value(map);
+    return Value(std::move(map));
 }
 
-parsing::Root runtime::parseFile(std::filesystem::path & path) {
-    std::string fileContents;
-    {
-        // Read the file to a string
-        std::ifstream file ( path );
-        if (!file) {
-            throw std::runtime_error("filesystem error: couldn't open file for reading");
-        }
+namespace {
+    /// Guards the startup profile, which every thread parsing imports adds to.
+    std::mutex profileMutex;
 
-        // Read until EOF (or until a null byte but oh well)
-        std::getline(file, fileContents, '\0');
+    void recordParse(const std::chrono::steady_clock::time_point start, const bool cacheHit) {
+        const std::lock_guard lock ( profileMutex );
+        startupProfile.filesParsed++;
+        if (cacheHit) startupProfile.cacheHits++;
+        startupProfile.parsing += std::chrono::steady_clock::now() - start;
+    }
+}
 
-        if (!file) {
-            throw std::runtime_error("filesystem error: failed to read file");
+parsing::Root runtime::parseFile(std::filesystem::path & path) {
+    // The tree copies everything it keeps out of the source, so the file can go once it's parsed
+    const source::File file ( path );
+    const auto fileContents = file.text();
+
+    const auto start = std::chrono::steady_clock::now();
+    std::error_code err;
+    const auto canonicalPath = file.fromStandardInput ? std::filesystem::path() : std::filesystem::canonical(path, err);
+    const auto cached = cache::enabled && !file.fromStandardInput && !err;
+    if (cached) {
+        parsing::Root syntaxTree;
+        if (cache::load(canonicalPath, fileContents, syntaxTree)) {
+            optimizer::fold(syntaxTree);
+            recordParse(start, true);
+            return syntaxTree;
         }
     }
 
     // Tokenize and parse the AST
     lexer::Lexer lexer ( fileContents, path );
-    parsing::Root syntaxTree;
-    parsing::Parser parser ( path );
-    lexer::Token token;
-    while (true) {
-        auto res = lexer.advanceToken(token);
-        // Feed it to the parser
-        parser.advance(token);
-        if (!res) break;
-    }
-    return parser.getSyntaxTree();
+    parsing::Parser parser ( lexer, path );
+    auto syntaxTree = parser.parse();
+    // The cache keeps the tree as it was written, so that it doesn't depend on whether folding is turned on
+    if (cached) cache::store(canonicalPath, fileContents, syntaxTree);
+    optimizer::fold(syntaxTree);
+    recordParse(start, false);
+    return syntaxTree;
+}
+
+void StartupProfile::print(std::ostream & stream) const {
+    const auto ms = [](const std::chrono::nanoseconds time) { return std::chrono::duration<double, std::milli>(time).count(); };
+    stream << "startup profile:" << std::endl
+        << "    parsing:   " << ms(parsing) << " ms (" << filesParsed << " files, " << cacheHits << " from cache)" << std::endl
+        << "    resolving: " << ms(resolving) << " ms (" << modulesResolved << " imports, " << resolutionHits
+            << " remembered, " << directoriesListed << " directories listed)" << std::endl
+        << "    total:     " << ms(total) << " ms" << std::endl;
 }
 
 std::list<std::filesystem::path> parsePaths() {
@@ -425,68 +529,233 @@ std::list<std::filesystem::path> parsePaths() {
 }
 static std::list<std::filesystem::path> searchPaths = parsePaths();
 
-std::shared_ptr<Module> runtime::initModule(
-    const std::filesystem::path & filepath,
-    parsing::Root & root,
-    Stackframe & frame,
-    std::unordered_map<std::filesystem::path, std::shared_ptr<Module>> & handled,
-    std::unordered_set<std::filesystem::path> cycles
-) {
-    cycles.insert(canonical(filepath));
-    auto module = std::make_shared<Module>();
-    frame.root = module;
-    // First, we scan for imports
-    for (const auto& item : root.items) {
-        if (
-            const auto use = std::dynamic_pointer_cast<parsing::Use>(item)
-        ) {
-            // Try to find a file to import
-            auto folderName = use->module.members.front();
-            auto moduleName = use->module.members.back();
-            auto paths = searchPaths;
-            paths.push_front(filepath.parent_path());
+namespace {
+    /// Finds the files `use` items name. Every directory is listed at most once per run, and every path that's been
+    /// resolved is remembered, so importing the same modules from many files doesn't touch the filesystem again.
+    class ModuleResolver {
+        /// The stems of every entry in each directory that's been listed.
+        std::unordered_map<std::filesystem::path, std::unordered_set<std::string>> stems {};
+        /// Resolved imports, keyed on the importing directory and the module path.
+        std::unordered_map<std::string, std::filesystem::path> resolved {};
+        std::unordered_map<std::filesystem::path, std::filesystem::path> canonicalPaths {};
+
+        /// @throw std::filesystem::filesystem_error If the directory couldn't be read.
+        bool contains(const std::filesystem::path & directory, const std::string & stem) {
+            auto it = stems.find(directory);
+            if (it == stems.end()) {
+                std::unordered_set<std::string> entries {};
+                for (const auto& child : std::filesystem::directory_iterator(directory))
+                    entries.insert(child.path().stem().string());
+                it = stems.emplace(directory, std::move(entries)).first;
+                startupProfile.directoriesListed++;
+            }
+            return it->second.count(stem) != 0;
+        }
+
+        std::filesystem::path search(Stackframe & frame, const std::filesystem::path & from, const parsing::Path & module) {
+            // Find the search root the first member lives in
+            auto roots = searchPaths;
+            roots.push_front(from);
             std::filesystem::path importPath;
-            for (const auto& path : paths) {
-                try {
-                    auto children = std::filesystem::directory_iterator(path);
-                    for (const auto& child : children) {
-                        const auto& childPath = child.path();
-                        if (childPath.stem() == folderName) {
-                            importPath = path;
-                            goto foundFolder;
-                        }
+            try {
+                for (const auto& root : roots) {
+                    if (contains(root, module.members.front().str())) {
+                        importPath = root;
+                        goto foundFolder;
                     }
-                } catch (std::exception & err) {
-                    throw RuntimeError(frame, "failed to read path: " + std::string(err.what()));
                 }
+            } catch (std::exception & err) {
+                throw RuntimeError(frame, "failed to read path: " + std::string(err.what()));
             }
-            throw RuntimeError(frame, "could not resolve module path: " + use->module.to_string());
+            throw RuntimeError(frame, "could not resolve module path: " + module.to_string());
 
         foundFolder:
-            // Search recursively for the right file
-            for (auto iter = use->module.members.begin(); iter != use->module.members.end(); ++iter) {
-                const auto& member = *iter;
-
-                auto children = std::filesystem::directory_iterator(importPath);
-                auto found = false;
-                for (const auto& child : children) {
-                    const auto& childPath = child.path();
-                    if (childPath.stem() == member) {
-                        importPath /= member;
-                        found = true;
-                        break;
-                    }
+            // Then walk down through the rest of them
+            for (const auto& member : module.members) {
+                bool found;
+                try {
+                    found = contains(importPath, member.str());
+                } catch (std::exception & err) {
+                    throw RuntimeError(frame, "failed to read path: " + std::string(err.what()));
                 }
                 if (!found)
                     throw RuntimeError(
                         frame,
-                        "could not resolve \"" + member + "\" in path \"" + importPath.generic_string() + "\": " +
-                        use->module.to_string()
+                        "could not resolve \"" + member.str() + "\" in path \"" + importPath.generic_string() + "\": " +
+                        module.to_string()
                     );
+                importPath /= member.str();
             }
 
             importPath.replace_extension(".spl");
-            auto path = canonical(importPath);
+            return canonical(importPath);
+        }
+
+    public:
+        std::filesystem::path canonical(const std::filesystem::path & path) {
+            auto it = canonicalPaths.find(path);
+            if (it != canonicalPaths.end()) return it->second;
+            // A script read from standard input is named after a file that isn't there, and a pipe like `<(...)`
+            // can't be resolved at all, so neither has to exist
+            std::error_code err;
+            auto canonicalPath = std::filesystem::weakly_canonical(path, err);
+            if (err) canonicalPath = std::filesystem::absolute(path);
+            return canonicalPaths.emplace(path, std::move(canonicalPath)).first->second;
+        }
+
+        /// @brief Finds the file a module path names.
+        /// @param from The directory of the file doing the importing.
+        /// @param counted Whether this counts as an import in the startup profile, which looking ahead doesn't.
+        std::filesystem::path resolve(
+            Stackframe & frame, const std::filesystem::path & from, const parsing::Path & module, const bool counted = true
+        ) {
+            const auto start = std::chrono::steady_clock::now();
+            auto key = from.string();
+            key += '\0';
+            key += module.to_string();
+            auto it = resolved.find(key);
+            if (it != resolved.end()) startupProfile.resolutionHits += counted;
+            else it = resolved.emplace(std::move(key), search(frame, from, module)).first;
+            startupProfile.resolving += std::chrono::steady_clock::now() - start;
+            startupProfile.modulesResolved += counted;
+            return it->second;
+        }
+    };
+
+    ModuleResolver moduleResolver {};
+
+    /// A tree parsed by parseImports, or what went wrong parsing it.
+    struct ParsedModule {
+        parsing::Root root;
+        std::exception_ptr error;
+    };
+
+    /// Trees parseImports got to ahead of time, which initModule takes as it reaches each import.
+    std::unordered_map<std::filesystem::path, ParsedModule> parsedAhead {};
+
+    /// @brief Takes the tree parsed ahead of time for a file, or parses it now if it wasn't.
+    parsing::Root takeParsed(std::filesystem::path & path) {
+        const auto it = parsedAhead.find(path);
+        if (it == parsedAhead.end()) return parseFile(path);
+        auto parsed = std::move(it->second);
+        parsedAhead.erase(it);
+        if (parsed.error) std::rethrow_exception(parsed.error);
+        return std::move(parsed.root);
+    }
+}
+
+void runtime::parseImports(const std::filesystem::path & filepath, const parsing::Root & root) {
+    if (parseJobs <= 1) return;
+
+    // Workers only ever parse. Resolving imports stays on this thread, so the resolver needs no lock
+    std::mutex mutex;
+    std::condition_variable work, done;
+    std::deque<std::filesystem::path> queue {};
+    std::vector<std::pair<std::filesystem::path, ParsedModule>> finished {};
+    bool stopping = false;
+
+    const auto worker = [&] {
+        std::unique_lock lock ( mutex );
+        while (true) {
+            work.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            auto path = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            ParsedModule parsed {};
+            try {
+                parsed.root = parseFile(path);
+            } catch (...) {
+                parsed.error = std::current_exception();
+            }
+            lock.lock();
+            finished.emplace_back(std::move(path), std::move(parsed));
+            done.notify_one();
+        }
+    };
+
+    // Anything that fails to resolve is left for initModule to report, so nothing is ever raised against this
+    Stackframe frame {
+        nullptr,
+        nullptr,
+        0,
+        nullptr,
+        "<imports>", {}
+    };
+    std::unordered_set<std::filesystem::path> seen { moduleResolver.canonical(filepath) };
+    size_t pending = 0;
+    const auto scan = [&](const std::filesystem::path & from, const parsing::Root & tree) {
+        for (const auto& item : tree.items) {
+            const auto use = dynamic_cast<parsing::Use *>(item);
+            if (!use) continue;
+            std::filesystem::path path;
+            try {
+                path = moduleResolver.resolve(frame, from.parent_path(), use->module, false);
+            } catch (const std::exception &) {
+                continue;
+            }
+            if (!seen.insert(path).second) continue;
+            pending++;
+            const std::lock_guard lock ( mutex );
+            queue.push_back(std::move(path));
+            work.notify_one();
+        }
+    };
+
+    // Outlives the workers, so the table keeps locking until every one of them has been joined
+    const intern::Shared shared {};
+    std::vector<std::thread> workers {};
+    scan(filepath, root);
+    while (pending) {
+        // There's never a thread started for nothing to do, so a few imports only take a few threads
+        try {
+            while (workers.size() < parseJobs && workers.size() < seen.size() - 1)
+                workers.emplace_back(worker);
+        } catch (const std::system_error &) {
+            // What's left is parsed as initModule gets to it
+            if (workers.empty()) break;
+        }
+
+        std::vector<std::pair<std::filesystem::path, ParsedModule>> batch {};
+        {
+            std::unique_lock lock ( mutex );
+            done.wait(lock, [&] { return !finished.empty(); });
+            batch.swap(finished);
+        }
+        for (auto& [path, parsed] : batch) {
+            pending--;
+            if (!parsed.error) scan(path, parsed.root);
+            parsedAhead.emplace(std::move(path), std::move(parsed));
+        }
+    }
+
+    {
+        const std::lock_guard lock ( mutex );
+        stopping = true;
+    }
+    work.notify_all();
+    for (auto& thread : workers)
+        thread.join();
+}
+
+std::shared_ptr<Module> runtime::initModule(
+    const std::filesystem::path & filepath,
+    parsing::Root & root,
+    Stackframe & frame,
+    std::unordered_map<std::filesystem::path, std::shared_ptr<Module>> & handled,
+    std::unordered_set<std::filesystem::path> cycles
+) {
+    cycles.insert(moduleResolver.canonical(filepath));
+    auto module = std::make_shared<Module>();
+    module->tree = root.arena;
+    frame.root = module.get();
+    // First, we scan for imports
+    for (const auto& item : root.items) {
+        if (
+            const auto use = dynamic_cast<parsing::Use *>(item)
+        ) {
+            auto moduleName = use->module.members.back();
+            auto path = moduleResolver.resolve(frame, filepath.parent_path(), use->module);
             // Check for dependency cycle
             if (cycles.count(path))
                 throw RuntimeError(frame, "dependency cycle detected for module " + use->module.to_string());
@@ -499,7 +768,7 @@ std::shared_ptr<Module> runtime::initModule(
 
             // Need to parse the file
             try {
-                auto moduleRoot = parseFile(path);
+                auto moduleRoot = takeParsed(path);
                 auto childFrame = frame.branch(use->position);
                 auto parsedModule = initModule(path, moduleRoot, childFrame, handled, cycles);
                 parsedModule->moduleName = moduleName;
@@ -515,23 +784,25 @@ std::shared_ptr<Module> runtime::initModule(
     // Then, we scan for functions
     for (const auto& item : root.items) {
         if (
-            const auto fn = std::dynamic_pointer_cast<parsing::Function>(item)
+            const auto fn = dynamic_cast<parsing::Function *>(item)
         ) {
             const auto synFn = std::make_shared<SyntaxFunction>();
             synFn->name = fn->name;
             synFn->pos = fn->position;
             synFn->argumentNames = fn->arguments;
+            synFn->module = module.get();
 
-            if ( const auto fnBlock = std::dynamic_pointer_cast<parsing::Block>(fn->body) )
+            if ( const auto fnBlock = dynamic_cast<parsing::Block *>(fn->body) )
                 synFn->body = fnBlock->statements;
             else synFn->body = { fn->body };
+            resolve(*synFn);
             module->functions[fn->name] = synFn;
         }
     }
     // Now, we scan for globals
     for (const auto& item : root.items) {
         if (
-            const auto decl = std::dynamic_pointer_cast<parsing::Declaration>(item)
+            const auto decl = dynamic_cast<parsing::Declaration *>(item)
         ) {
             module->globals[decl->name] = decl->value->result(frame);
         }
@@ -539,103 +810,143 @@ std::shared_ptr<Module> runtime::initModule(
     return module;
 }
 
-#define IF_DOWNCAST(type, name) if (auto name = std::dynamic_pointer_cast<type>(stmt))
+#define IF_DOWNCAST(type, name) if (auto name = dynamic_cast<type *>(stmt))
 
-struct LoopBreak { Stackframe & frame; };
-struct LoopContinue { Stackframe & frame; };
-struct FnReturn { Value value; };
+/// How a statement finished executing. Control flow is passed back up as a value instead of unwinding,
+/// since throwing on every return or continue is far too slow.
+/// A tail call completes as a return, with the call to make left in the TailCall.
+enum struct Completion { NORMAL, BREAK, CONTINUE, RETURN };
 
 using namespace parsing;
 
-void handleFrame(Stackframe & frame);
+Completion handleBlock(Stackframe & frame, const std::vector<Statement *> & statements, Value & returned, TailCall & tail);
 
-void handleStatement(Stackframe & frame, const std::shared_ptr<Statement>& stmt) {
+Completion handleStatement(Stackframe & frame, Statement * stmt, Value & returned, TailCall & tail) {
     frame.sourcePos = stmt->position;
+    if (profiler::due()) profiler::sample(frame);
+    counters::count(&counters::Counts::statements);
 
     IF_DOWNCAST(Block, block) {
-        Stackframe childFrame = frame.branch(block->position);
-        childFrame.body = block->statements;
-        handleFrame(childFrame);
+        return handleBlock(frame, block->statements, returned, tail);
     } else IF_DOWNCAST(ExpressionStatement, expr) {
         expr->expr->result(frame);
     } else IF_DOWNCAST(IfElse, ifelse) {
         auto predicate =
             ifelse->predicate->result(frame)
             .asBoolean();
-        auto path = predicate ? ifelse->truePath : ifelse->falsePath;
-        if (path) { // These may be null
-            Stackframe childFrame = frame.branch(path->position);
-            handleStatement(childFrame, path);
-        }
+        const auto& path = predicate ? ifelse->truePath : ifelse->falsePath;
+        if (path) // These may be null
+            return handleStatement(frame, path, returned, tail);
     } else IF_DOWNCAST(TryRecover, tryrecv) {
-        Stackframe childFrame = frame.branch(tryrecv->position);
         try {
-            handleStatement(childFrame, tryrecv->happyPath);
+            return handleStatement(frame, tryrecv->happyPath, returned, tail);
         } catch (RuntimeError & err) {
             if (!tryrecv->binding.members.empty()) {
-                childFrame.variables = {};
-                childFrame.assignVariable(tryrecv->binding, Value(err.message));
-                handleStatement(childFrame, tryrecv->sadPath);
+                *frame.getVariable(tryrecv->binding) = Value(err.message);
+                return handleStatement(frame, tryrecv->sadPath, returned, tail);
             }
         }
     } else IF_DOWNCAST(Loop, loop) {
         while (true) {
-            try {
-                Stackframe childFrame = frame.branch(loop->position);
-                childFrame.body = {loop->body};
-                handleFrame(childFrame);
-            }
-            catch (LoopBreak & _) { break; }
-            catch (LoopContinue & _) {}
+            auto completion = handleStatement(frame, loop->body, returned, tail);
+            if (completion == Completion::BREAK) break;
+            if (completion == Completion::RETURN) return completion;
         }
     } else IF_DOWNCAST(Declaration, decl) {
         auto res = decl->value->result(frame);
-        frame.variables[decl->name] = res;
+        frame.locals[decl->slot] = res;
+    }
+    else if (dynamic_cast<Break *>(stmt) != nullptr)
+        return Completion::BREAK;
+    else if (dynamic_cast<Continue *>(stmt) != nullptr)
+        return Completion::CONTINUE;
+    else IF_DOWNCAST(Return, ret) {
+        if (ret->tailCall) {
+            const auto& call = static_cast<const Call &>(*ret->value);
+            frame.sourcePos = call.position;
+            auto& fn = frame.root->resolveCall(frame, call.functionPath);
+            auto args = evaluateArguments(frame, call);
+            // Only syntax functions can take over this frame, anything else is just called
+            if (const auto syntaxFn = dynamic_cast<SyntaxFunction*>(&fn)) {
+                tail.function = syntaxFn;
+                tail.args = std::move(args);
+            } else {
+                if (counters::enabled) counters::native(fn, call.functionPath);
+                returned = fn.call(frame, args);
+            }
+            return Completion::RETURN;
+        }
+        returned = ret->value->result(frame);
+        return Completion::RETURN;
     }
-    else IF_DOWNCAST(Break, brk)
-        throw LoopBreak {frame};
-    else IF_DOWNCAST(Continue, cont)
-        throw LoopContinue {frame};
-    else IF_DOWNCAST(Return, ret)
-        throw FnReturn { ret->value->result(frame) };
     else
         throw RuntimeError(frame, "internal error: could not downcast " + stmt->to_string());
+    return Completion::NORMAL;
 }
 
-void handleFrame(Stackframe & frame) {
-    for (const auto& stmt : frame.body) {
-        frame.sourcePos = stmt->position;
-        handleStatement(frame, stmt);
+Completion handleBlock(Stackframe & frame, const std::vector<Statement *> & statements, Value & returned, TailCall & tail) {
+    for (const auto& stmt : statements) {
+        auto completion = handleStatement(frame, stmt, returned, tail);
+        if (completion != Completion::NORMAL) return completion;
     }
+    return Completion::NORMAL;
+}
+
+/// @brief Gets how much native stack calls can use up, leaving some room for whatever the deepest one does.
+static size_t nativeStackBudget() {
+    rlimit limit {};
+    size_t size = 8 << 20;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = limit.rlim_cur;
+    return size / 4 * 3;
+}
+
+void SyntaxFunction::enter(Stackframe & frame, Value * args, size_t count, LocalStack::Mark & mark) {
+    frame.root = module;
+    frame.functionName = name.str();
+    frame.sourcePos = pos;
+
+    frame.locals = localStack.push(localCount, mark);
+    for (size_t i = 0; i < argumentSlots.size(); i++)
+        frame.locals[argumentSlots[i]] = i < count ? std::move(args[i]) : Value();
+    frame.locals[argcSlot] = Value((int64_t) count);
+    if (counters::enabled) counters::call(frame);
 }
 
 Value SyntaxFunction::call(Stackframe &frame, std::vector<Value> & args) {
-    std::unordered_map<std::string, Value> variables = {};
-    auto iter = argumentNames.begin();
-    for (const auto& arg : args) {
-        if (iter == argumentNames.end()) break;
-        variables[*iter] = arg;
-        ++iter;
-    }
-    for (; iter != argumentNames.end(); ++iter) {
-        variables[*iter] = Value();
-    }
-    variables["__ARGC"] = Value((int64_t) args.size());
+    // The virtual machine keeps its calls on the heap, but the tree-walker and global initializers still nest natively,
+    // so they have to stop before the native stack runs out, however high the depth limit is
+    static const auto stackBudget = nativeStackBudget();
+    char marker;
+    static const auto stackBase = reinterpret_cast<uintptr_t>(&marker);
+    if (stackBase - reinterpret_cast<uintptr_t>(&marker) > stackBudget)
+        throw RuntimeError(frame, "ran out of native stack space");
+
+    // Whatever the call does is counted against it, and against the caller again once it returns
+    const counters::Scope countedScope;
+    if (!useTreeWalker) return bytecode::execute(*this, frame, args);
+
     auto childFrame = frame.branch(pos);
-    childFrame.variables = variables;
-    childFrame.functionName = name;
-    childFrame.body = body;
-    childFrame.boundary = true;
-
-    try {
-        handleFrame(childFrame);
-    } catch (LoopBreak brk) {
-        throw RuntimeError(brk.frame, "unhandled break statement");
-    } catch (LoopContinue cont) {
-        throw RuntimeError(cont.frame, "unhandled continue statement");
-    } catch (FnReturn ret) {
-        return ret.value;
-    }
+    LocalsGuard guard {};
+
+    // Each tail call replaces the function running in this frame, until one of them returns a value
+    SyntaxFunction * function = this;
+    TailCall tail;
+    while (true) {
+        function->enter(childFrame, args.data(), args.size(), guard.mark);
 
-    return {};
+        Value returned;
+        switch (handleBlock(childFrame, function->body, returned, tail)) {
+            case Completion::BREAK: throw RuntimeError(childFrame, "unhandled break statement");
+            case Completion::CONTINUE: throw RuntimeError(childFrame, "unhandled continue statement");
+            default: break;
+        }
+        if (!tail.function) return returned;
+
+        function = tail.function;
+        tail.function = nullptr;
+        // The arguments already hold everything they need from the old locals
+        args = std::move(tail.args);
+        localStack.release(guard.mark);
+    }
 }
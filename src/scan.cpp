@@ -0,0 +1,195 @@
+#include "scan.h"
+
+#if defined(__SSE2__) && !defined(SHRIMPLY_NO_SIMD)
+#define SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+using namespace scan;
+
+namespace {
+    const char * skipClass(const char * cursor, const char * end, const CharClass cls) {
+        while (cursor < end && is(*cursor, cls)) cursor++;
+        return cursor;
+    }
+
+#ifdef SCAN_SSE2
+    constexpr ptrdiff_t WIDTH = 16;
+
+    __m128i load(const char * cursor) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(cursor)); }
+    __m128i splat(const char chr) { return _mm_set1_epi8(chr); }
+    uint32_t bits(const __m128i mask) { return (uint32_t) _mm_movemask_epi8(mask); }
+
+    /// @brief Marks the bytes that are in a range, compared as unsigned.
+    __m128i between(const __m128i bytes, const char low, const char high) {
+        const auto shifted = _mm_sub_epi8(bytes, splat(low));
+        return _mm_cmpeq_epi8(_mm_min_epu8(shifted, splat((char) (high - low))), shifted);
+    }
+
+    /// @brief Skips a block at a time for as long as every byte is marked, and then one byte at a time for the
+    /// part too short to make a block.
+    template<typename Marker>
+    const char * skipRun(const char * cursor, const char * end, const CharClass cls, Marker mark) {
+        for (; end - cursor >= WIDTH; cursor += WIDTH) {
+            if (const auto outside = ~bits(mark(load(cursor))) & 0xFFFF)
+                return cursor + __builtin_ctz(outside);
+        }
+        return skipClass(cursor, end, cls);
+    }
+#endif
+
+#ifdef SCAN_AVX2
+    /// These only go over whole blocks, advancing the cursor past them, and leave the rest to the SSE2 loops.
+    namespace avx2 {
+#define AVX2 __attribute__((target("avx2,popcnt")))
+        constexpr ptrdiff_t WIDTH = 32;
+
+        const bool supported = [] {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") != 0;
+        }();
+
+        AVX2 __m256i load(const char * cursor) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cursor)); }
+        AVX2 uint32_t find(const __m256i bytes, const char chr) {
+            return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(chr)));
+        }
+
+        AVX2 bool isAscii(const char *& cursor, const char * end) {
+            auto seen = _mm256_setzero_si256();
+            for (; end - cursor >= WIDTH; cursor += WIDTH)
+                seen = _mm256_or_si256(seen, load(cursor));
+            return _mm256_movemask_epi8(seen) == 0;
+        }
+
+        AVX2 size_t countNewlines(const char *& cursor, const char * end, const char *& last) {
+            size_t count = 0;
+            for (; end - cursor >= WIDTH; cursor += WIDTH) {
+                const auto found = find(load(cursor), '\n');
+                if (!found) continue;
+                count += __builtin_popcount(found);
+                last = cursor + 31 - __builtin_clz(found);
+            }
+            return count;
+        }
+
+        AVX2 const char * findCommentEnd(const char *& cursor, const char * end) {
+            // Each block is paired up with the one a byte after it, so this needs a byte past the block
+            for (; end - cursor > WIDTH; cursor += WIDTH) {
+                if (const auto found = find(load(cursor), '*') & find(load(cursor + 1), '/'))
+                    return cursor + __builtin_ctz(found);
+            }
+            return nullptr;
+        }
+
+        AVX2 const char * findQuoteOrEscape(const char *& cursor, const char * end) {
+            for (; end - cursor >= WIDTH; cursor += WIDTH) {
+                const auto bytes = load(cursor);
+                if (const auto found = find(bytes, '"') | find(bytes, '\\'))
+                    return cursor + __builtin_ctz(found);
+            }
+            return nullptr;
+        }
+#undef AVX2
+    }
+#endif
+}
+
+bool scan::isAscii(const char * begin, const char * end) {
+    auto cursor = begin;
+#ifdef SCAN_AVX2
+    if (avx2::supported && !avx2::isAscii(cursor, end)) return false;
+#endif
+#ifdef SCAN_SSE2
+    auto seen = _mm_setzero_si128();
+    for (; end - cursor >= WIDTH; cursor += WIDTH)
+        seen = _mm_or_si128(seen, load(cursor));
+    if (bits(seen)) return false;
+#endif
+    for (; cursor < end; cursor++)
+        if ((unsigned char) *cursor >= 0x80) return false;
+    return true;
+}
+
+const char * scan::skipLong(const char * begin, const char * end, const CharClass cls) {
+#ifdef SCAN_SSE2
+    switch (cls) {
+        case SPACE:
+            return skipRun(begin, end, cls, [](const __m128i bytes) {
+                return _mm_or_si128(_mm_cmpeq_epi8(bytes, splat(' ')), between(bytes, '\t', '\r'));
+            });
+        case IDENT:
+            return skipRun(begin, end, cls, [](const __m128i bytes) {
+                // Setting 0x20 lowercases letters, without moving anything else into a-z
+                const auto letters = between(_mm_or_si128(bytes, splat(0x20)), 'a', 'z');
+                return _mm_or_si128(_mm_or_si128(letters, between(bytes, '0', '9')), _mm_cmpeq_epi8(bytes, splat('_')));
+            });
+        case DIGIT:
+            return skipRun(begin, end, cls, [](const __m128i bytes) { return between(bytes, '0', '9'); });
+        default:
+            break;
+    }
+#endif
+    return skipClass(begin, end, cls);
+}
+
+const char * scan::findCommentEnd(const char * begin, const char * end) {
+    auto cursor = begin;
+#ifdef SCAN_AVX2
+    if (avx2::supported)
+        if (const auto found = avx2::findCommentEnd(cursor, end)) return found;
+#endif
+#ifdef SCAN_SSE2
+    for (; end - cursor > WIDTH; cursor += WIDTH) {
+        const auto stars = bits(_mm_cmpeq_epi8(load(cursor), splat('*')));
+        if (const auto found = stars & bits(_mm_cmpeq_epi8(load(cursor + 1), splat('/'))))
+            return cursor + __builtin_ctz(found);
+    }
+#endif
+    for (; end - cursor >= 2; cursor++)
+        if (cursor[0] == '*' && cursor[1] == '/') return cursor;
+    return end;
+}
+
+const char * scan::findQuoteOrEscape(const char * begin, const char * end) {
+    auto cursor = begin;
+#ifdef SCAN_AVX2
+    if (avx2::supported)
+        if (const auto found = avx2::findQuoteOrEscape(cursor, end)) return found;
+#endif
+#ifdef SCAN_SSE2
+    for (; end - cursor >= WIDTH; cursor += WIDTH) {
+        const auto bytes = load(cursor);
+        if (const auto found = bits(_mm_or_si128(_mm_cmpeq_epi8(bytes, splat('"')), _mm_cmpeq_epi8(bytes, splat('\\')))))
+            return cursor + __builtin_ctz(found);
+    }
+#endif
+    for (; cursor < end; cursor++)
+        if (*cursor == '"' || *cursor == '\\') return cursor;
+    return end;
+}
+
+size_t scan::countNewlinesLong(const char * begin, const char * end, const char *& last) {
+    size_t count = 0;
+    auto cursor = begin;
+#ifdef SCAN_AVX2
+    if (avx2::supported) count += avx2::countNewlines(cursor, end, last);
+#endif
+#ifdef SCAN_SSE2
+    for (; end - cursor >= WIDTH; cursor += WIDTH) {
+        const auto found = bits(_mm_cmpeq_epi8(load(cursor), splat('\n')));
+        if (!found) continue;
+        count += __builtin_popcount(found);
+        last = cursor + 31 - __builtin_clz(found);
+    }
+#endif
+    for (; cursor < end; cursor++) {
+        if (*cursor != '\n') continue;
+        count++;
+        last = cursor;
+    }
+    return count;
+}
@@ -0,0 +1,65 @@
+#include "source.h"
+
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace source;
+
+namespace {
+    /// How much more is read at a time from anything whose size isn't known up front.
+    constexpr size_t CHUNK_SIZE = 1 << 16;
+}
+
+File::File(const std::filesystem::path & path) {
+    fromStandardInput = path == STANDARD_INPUT;
+    const int fd = fromStandardInput ? STDIN_FILENO : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("filesystem error: couldn't open file for reading");
+
+    struct stat info {};
+    const auto regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    // Mapping starts from the beginning of the file, which standard input might already be past
+    if (regular && info.st_size > 0 && !fromStandardInput) {
+        const auto mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            mapping = mapped;
+            mappedSize = info.st_size;
+            madvise(mapping, mappedSize, MADV_SEQUENTIAL);
+            contents = { static_cast<const char *>(mapping), mappedSize };
+        }
+    }
+
+    try {
+        if (!mapping) readAll(fd, regular ? info.st_size : 0);
+    } catch (...) {
+        if (!fromStandardInput) close(fd);
+        throw;
+    }
+    if (!fromStandardInput) close(fd);
+}
+
+File::~File() {
+    if (mapping) munmap(mapping, mappedSize);
+}
+
+void File::readAll(const int fd, const size_t sizeHint) {
+    // Reading a byte past the expected size finds the end of a regular file without another call
+    size_t used = 0;
+    buffer.resize(sizeHint + 1 > CHUNK_SIZE ? sizeHint + 1 : CHUNK_SIZE);
+    while (true) {
+        if (used == buffer.size()) buffer.resize(buffer.size() * 2);
+        const auto count = read(fd, buffer.data() + used, buffer.size() - used);
+        if (count == 0) break;
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("filesystem error: failed to read file");
+        }
+        used += count;
+    }
+    buffer.resize(used);
+    contents = buffer;
+}
@@ -90,7 +90,7 @@ struct Length final: AbstractFunction {
             case Value::ValueType::List:
                 return Value((int64_t) value.list->size());
             case Value::ValueType::String:
-                return Value((int64_t) value.string.size());
+                return Value((int64_t) value.string->size());
             case Value::ValueType::Map:
                 return Value((int64_t) value.map->size());
             default:
@@ -105,9 +105,8 @@ struct Push final: AbstractFunction {
     Value call(Stackframe &frame, std::vector<Value> & args) override {
         EXPECT_ARGC(2);
         const Value& list = args[0];
-        const Value& value = args[1];
         if (list.tag != Value::ValueType::List) throw RuntimeError(frame, "cannot push to non-list: " + list.raw_string());
-        list.list->push_back(value);
+        list.list->push_back(std::move(args[1]));
         return {};
     }
 };
@@ -118,12 +117,31 @@ struct Pop final: AbstractFunction {
         const Value& list = args[0];
         if (list.tag != Value::ValueType::List) throw RuntimeError(frame, "cannot pop from non-list: " + list.raw_string());
         if (list.list->empty()) throw RuntimeError(frame, "cannot pop from empty list");
-        auto back = list.list->back();
+        auto back = std::move(list.list->back());
         list.list->pop_back();
         return back;
     }
 };
 
+/// Both std::list::get and std::map::get, each only taking its own kind of container.
+struct Get final: AbstractFunction {
+    const Value::ValueType type;
+
+    explicit Get(const Value::ValueType type) : type(type) {}
+
+    Value call(Stackframe &frame, std::vector<Value> & args) override {
+        EXPECT_ARGC(2);
+        if (args[0].tag != type)
+            throw RuntimeError(
+                frame,
+                std::string(type == Value::ValueType::List ? "expected a list: " : "expected a map: ") + args[0].raw_string()
+            );
+        Value found;
+        if (runtime::tryIndex(frame, args[0], args[1], found)) return found;
+        return args.size() > 2 ? std::move(args[2]) : Value();
+    }
+};
+
 // map
 
 struct Remove final: AbstractFunction {
@@ -132,9 +150,10 @@ struct Remove final: AbstractFunction {
         const Value& map = args[0];
         if (map.tag != Value::ValueType::Map) throw RuntimeError(frame, "cannot remove from non-map: " + map.raw_string());
         const std::string key = args[1].to_string();
-        const auto it = map.map->find(key);
+        intern::Symbol symbol;
+        const auto it = args[1].asKey(symbol, false) ? map.map->find(symbol) : map.map->end();
         if (it == map.map->end()) throw RuntimeError(frame, "key does not exist in map: " + key);
-        auto val = it->second;
+        auto val = std::move(it->second);
         map.map->erase(it);
         return val;
     }
@@ -145,10 +164,10 @@ struct Keys final: AbstractFunction {
         EXPECT_ARGC(1);
         const Value& map = args[0];
         if (map.tag != Value::ValueType::Map) throw RuntimeError(frame, "cannot get keys of non-map: " + map.raw_string());
-        auto keys = std::make_shared<std::vector<Value>>();
-        keys->reserve(map.map->size());
-        for (const auto& pair : *map.map) keys->emplace_back(pair.first);
-        return Value(keys);
+        value::List keys;
+        keys.reserve(map.map->size());
+        for (const auto& pair : *map.map) keys.emplace_back(pair.first.str());
+        return Value(std::move(keys));
     }
 };
 
@@ -157,10 +176,10 @@ struct Values final: AbstractFunction {
         EXPECT_ARGC(1);
         const Value& map = args[0];
         if (map.tag != Value::ValueType::Map) throw RuntimeError(frame, "cannot get values of non-map: " + map.raw_string());
-        auto values = std::make_shared<std::vector<Value>>();
-        values->reserve(map.map->size());
-        for (const auto& pair : *map.map) values->push_back(pair.second);
-        return Value(values);
+        value::List values;
+        values.reserve(map.map->size());
+        for (const auto& pair : *map.map) values.push_back(pair.second);
+        return Value(std::move(values));
     }
 };
 
@@ -169,9 +188,8 @@ struct Contains final: AbstractFunction {
         EXPECT_ARGC(2);
         const Value& map = args[0];
         if (map.tag != Value::ValueType::Map) throw RuntimeError(frame, "cannot find value in non-map: " + map.raw_string());
-        const std::string key = args[1].to_string();
-        const auto it = map.map->find(key);
-        return Value(it != map.map->end());
+        intern::Symbol key;
+        return Value(args[1].asKey(key, false) && map.map->find(key) != map.map->end());
     }
 };
 
@@ -184,8 +202,8 @@ struct Substring final: AbstractFunction {
         int64_t start; EXPECT_TYPE(start, args[1], asInteger, "integer");
         int64_t end; EXPECT_TYPE(end, args[2], asInteger, "integer");
         if (start > end) throw RuntimeError(frame, "substring start cannot be greater than end");
-        if (0 > start || start > haystack.size()) throw RuntimeError(frame, "substring start out of bounds");
-        if (0 > end || end > haystack.size()) throw RuntimeError(frame, "substring end out of bounds");
+        if (0 > start || static_cast<size_t>(start) > haystack.size()) throw RuntimeError(frame, "substring start out of bounds");
+        if (0 > end || static_cast<size_t>(end) > haystack.size()) throw RuntimeError(frame, "substring end out of bounds");
         return Value(haystack.substr(start, end));
     }
 };
@@ -229,7 +247,7 @@ struct Byte final: AbstractFunction {
         std::string val = args[0].asString();
         int64_t index = 0;
         if (args.size() > 1) EXPECT_TYPE(index, args[1], asInteger, "integer");
-        if (index < 0 || index >= val.size()) throw RuntimeError(frame, "index is out of bounds for string");
+        if (index < 0 || static_cast<size_t>(index) >= val.size()) throw RuntimeError(frame, "index is out of bounds for string");
         return Value((int64_t) (unsigned char) val[index]);
     }
 };
@@ -410,12 +428,14 @@ std::shared_ptr<runtime::Module> initStdlib() {
     std->imported["list"] = list;
     list->functions["push"] = std::make_shared<Push>();
     list->functions["pop"] = std::make_shared<Pop>();
+    list->functions["get"] = std::make_shared<Get>(Value::ValueType::List);
     auto map = std::make_shared<runtime::Module>(true);
     std->imported["map"] = map;
     map->functions["remove"] = std::make_shared<Remove>();
     map->functions["keys"] = std::make_shared<Keys>();
     map->functions["values"] = std::make_shared<Values>();
     map->functions["contains"] = std::make_shared<Contains>();
+    map->functions["get"] = std::make_shared<Get>(Value::ValueType::Map);
     auto string = std::make_shared<runtime::Module>(true);
     std->imported["string"] = string;
     string->functions["find"] = std::make_shared<Find>();
@@ -1,10 +1,7 @@
 #include "../include/value.h"
 
-#include <unordered_set>
 using namespace value;
 
-unsigned long long Value::counter = 0;
-
 std::string value::escapeString(const std::string& string) {
     std::ostringstream stream;
     stream << std::hex << '"';
@@ -28,38 +25,89 @@ std::string value::escapeString(const std::string& string) {
     return stream.str();
 }
 
-std::string Value::raw_string(std::unordered_set<unsigned long long> seenIds) const {
-    if (seenIds.find(id) != seenIds.end()) return "...";
+void Value::destroy() {
+    switch (tag) {
+        case ValueType::String: delete static_cast<Boxed<std::string>*>(object); break;
+        case ValueType::List: delete static_cast<Boxed<value::List>*>(object); break;
+        case ValueType::Map: delete static_cast<Boxed<value::Map>*>(object); break;
+        default: break;
+    }
+}
+
+Value Value::deepCopy() const {
+    // Copy the container wholesale, then give any nested containers their own copies
+    if (tag == ValueType::List) {
+        Value copy { value::List(*list) };
+        for (auto& member : *copy.list)
+            if (member.tag == ValueType::List || member.tag == ValueType::Map) member = member.deepCopy();
+        return copy;
+    }
+    if (tag == ValueType::Map) {
+        Value copy { value::Map(*map) };
+        for (auto& [key, member] : *copy.map)
+            if (member.tag == ValueType::List || member.tag == ValueType::Map) member = member.deepCopy();
+        return copy;
+    }
+    return *this;
+}
+
+bool Value::asKey(intern::Symbol & out, const bool create) const {
+    if (tag != ValueType::String) {
+        if (!create) return intern::Symbol::find(to_string(), out);
+        out = intern::Symbol::key(to_string());
+        return true;
+    }
+    const auto box = static_cast<Boxed<std::string>*>(object);
+    if (!box->interned) {
+        if (create) box->symbol = intern::Symbol::key(box->data);
+        else if (!intern::Symbol::find(box->data, box->symbol)) return false;
+        box->interned = true;
+    }
+    out = box->symbol;
+    return true;
+}
+
+std::string Value::raw_string() const {
+    std::vector<const Object*> ancestors;
+    return raw_string(ancestors);
+}
+
+std::string Value::raw_string(std::vector<const Object*> & ancestors) const {
+    if (tag == ValueType::List || tag == ValueType::Map) {
+        for (const auto ancestor : ancestors)
+            if (ancestor == object) return "...";
+    }
     switch (tag) {
         case ValueType::Null: return "null";
-        case ValueType::String: return escapeString(string);
+        case ValueType::String: return escapeString(*string);
         case ValueType::Boolean: return boolean ? "true" : "false";
         case ValueType::Integer: return std::to_string(integer);
         case ValueType::Number: return std::to_string(number);
         case ValueType::List: {
-            seenIds.insert(id);
+            ancestors.push_back(object);
             std::stringstream stream;
             stream << "[";
             for (size_t i = 0; i < list->size(); i++) {
                 if (i != 0) stream << ", ";
-                auto value = list->at(i);
-                stream << value.raw_string(seenIds);
+                stream << list->at(i).raw_string(ancestors);
             }
             stream << "]";
+            ancestors.pop_back();
             return stream.str();
         }
         case ValueType::Map: {
-            seenIds.insert(id);
+            ancestors.push_back(object);
             std::stringstream stream;
             stream << "(";
             size_t i = 0;
             for (const auto& pair : *map) {
                 if (i != 0) stream << ", ";
-                stream << escapeString(pair.first) << " = ";
-                stream << pair.second.raw_string(seenIds);
+                stream << escapeString(pair.first.str()) << " = ";
+                stream << pair.second.raw_string(ancestors);
                 i++;
             }
             stream << ")";
+            ancestors.pop_back();
             return stream.str();
         }
         case ValueType::Extern: {
@@ -70,4 +118,4 @@ std::string Value::raw_string(std::unordered_set<unsigned long long> seenIds) co
         default:
             throw std::runtime_error("internal runtime error: malformed value");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,470 @@
+#include <cmath>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bytecode.h"
+#include "counters.h"
+#include "profiler.h"
+#include "runtime.h"
+
+using namespace bytecode;
+using runtime::Stackframe;
+using exceptions::RuntimeError;
+using lexer::TokenType;
+using value::Value;
+
+// GCC and Clang support taking the address of a label, which lets every handler jump straight to the next one
+// instead of bouncing through a single switch. Anything else falls back to the switch.
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+// Only an instrumented run counts instructions or looks for timer ticks, so a plain run dispatches exactly as if there
+// were no counters or profiler.
+#define INSTRUMENT() do { \
+        if constexpr (INSTRUMENTED) { \
+            if (counters::enabled) counters::current->instructions++; \
+            if (profiler::due()) { \
+                SYNC_POSITION(); \
+                profiler::sample(*frame); \
+            } \
+        } \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+#define OP(name) op_##name:
+#define DISPATCH() do { \
+        instr = &code[ip]; \
+        ip++; \
+        INSTRUMENT(); \
+        goto *dispatchTable[(size_t) instr->op]; \
+    } while (false)
+#define NEXT DISPATCH()
+#else
+#define OP(name) case Opcode::name:
+#define DISPATCH() do { } while (false)
+#define NEXT continue
+#endif
+
+// Only the source position of the instruction that raises an error or makes a call is ever read, so handlers that
+// can do either bring the frame up to date themselves instead of every dispatch doing it.
+#define SYNC_POSITION() frame->sourcePos = positions[ip - 1]
+
+// Computed gotos don't run destructors when they leave a scope, so every handler's locals live in a block that
+// closes before it dispatches.
+#define BINARY(name, opr) OP(name) { \
+        SYNC_POSITION(); \
+        auto result = runtime::binaryOperation(*frame, TokenType::opr, stack[stack.size() - 2], stack.back()); \
+        stack.pop_back(); \
+        stack.back() = std::move(result); \
+    } \
+    NEXT;
+
+// Arithmetic and comparisons quicken: once an instruction sees two integers or two numbers, it's rewritten into a
+// version specialized for them, which only has to check both tags before doing the math inline.
+#define QUICKENING(name, opr) OP(name) { \
+        auto& left = stack[stack.size() - 2]; \
+        const auto& right = stack.back(); \
+        if (left.tag == right.tag) { \
+            if (left.tag == Value::ValueType::Integer) instr->op = Opcode::name##_INT; \
+            else if (left.tag == Value::ValueType::Number) instr->op = Opcode::name##_NUM; \
+        } \
+        SYNC_POSITION(); \
+        left = runtime::binaryOperation(*frame, TokenType::opr, left, right); \
+        stack.pop_back(); \
+    } \
+    NEXT;
+
+// Points the registers at the activation on top of the stack.
+#define ENTER(activation) do { \
+        current = &(activation); \
+        frame = &current->frame; \
+        chunk = current->chunk; \
+        code = chunk->code.data(); \
+        positions = chunk->positions.data(); \
+        locals = frame->locals; \
+        if constexpr (INSTRUMENTED) if (counters::enabled) counters::resume(*frame); \
+    } while (false)
+
+// If a specialized instruction's guard fails, it does the generic operation instead and rewrites itself back.
+// These have to give exactly what binaryOperation would, which is why comparisons still go through doubles.
+#define SPECIALIZED(name, generic, opr, type, guard, expr) OP(name) { \
+        auto& left = stack[stack.size() - 2]; \
+        const auto& right = stack.back(); \
+        if (left.tag == Value::ValueType::type && right.tag == Value::ValueType::type && (guard)) { \
+            left = Value(expr); \
+        } else { \
+            instr->op = Opcode::generic; \
+            SYNC_POSITION(); \
+            left = runtime::binaryOperation(*frame, TokenType::opr, left, right); \
+        } \
+        stack.pop_back(); \
+    } \
+    NEXT;
+#define INT_OP(name, opr, guard, expr) SPECIALIZED(name##_INT, name, opr, Integer, guard, expr)
+#define NUM_OP(name, opr, expr) SPECIALIZED(name##_NUM, name, opr, Number, true, expr)
+
+namespace {
+    /// An installed try block.
+    struct Handler {
+        /// Where to jump when an error is caught.
+        uint32_t target;
+        /// How deep the stack was when the handler was installed.
+        size_t stackSize;
+        /// Which activation installed the handler.
+        size_t activation;
+    };
+
+    /// A call running on the virtual machine.
+    struct Activation {
+        Stackframe frame;
+        Chunk * chunk;
+        /// Where to carry on from once the call this one is making returns.
+        size_t ip;
+        /// Where this call's operands start on the operand stack.
+        size_t stackBase;
+        /// How many handlers were installed before this call started.
+        size_t handlerBase;
+        runtime::LocalStack::Mark mark;
+    };
+
+    /// Every call running on the virtual machine. Like the local stack, storage is split into segments that are kept
+    /// once they're allocated, so activations never move and frames can keep pointing at their parents.
+    class ActivationStack {
+        static constexpr size_t SEGMENT_SIZE = 256;
+
+        std::vector<std::unique_ptr<Activation[]>> segments {};
+        size_t count = 0;
+    public:
+        size_t size() const { return count; }
+
+        Activation & top() { return segments[(count - 1) / SEGMENT_SIZE][(count - 1) % SEGMENT_SIZE]; }
+
+        Activation & push() {
+            if (count / SEGMENT_SIZE == segments.size())
+                segments.push_back(std::make_unique<Activation[]>(SEGMENT_SIZE));
+            count++;
+            return top();
+        }
+
+        /// @brief Ends the call on top, giving its locals back.
+        void pop() {
+            runtime::localStack.release(top().mark);
+            count--;
+        }
+    };
+
+    ActivationStack activations;
+
+    /// Ends whatever calls an invocation of the virtual machine left running, however it exits.
+    struct ActivationsGuard {
+        size_t base;
+        ~ActivationsGuard() {
+            while (activations.size() > base)
+                activations.pop();
+        }
+    };
+
+    /// @brief Starts a call on top of the activation stack.
+    /// @param args The arguments, which are moved into the callee's locals.
+    /// @param stackBase Where the callee's operands will start.
+    /// @throw exceptions::RuntimeError If calls are already nested as deep as they're allowed to be.
+    Activation & begin(
+        runtime::SyntaxFunction & function, Stackframe & caller,
+        Value * args, size_t count,
+        size_t stackBase, size_t handlerBase
+    ) {
+        if (!function.chunk) function.chunk = compile(function);
+        auto frame = caller.branch(function.pos);
+        auto& activation = activations.push();
+        activation.frame = frame;
+        activation.chunk = function.chunk.get();
+        activation.stackBase = stackBase;
+        activation.handlerBase = handlerBase;
+        function.enter(activation.frame, args, count, activation.mark);
+        return activation;
+    }
+}
+
+/// @brief Runs a call to a syntax function, and any calls it makes, until it returns.
+/// There's one of these for when the profiler or the counters are running and one for when neither is. Having one for
+/// every combination makes this file too big for the compiler to inline everything it should into the plain one.
+template<bool INSTRUMENTED>
+static Value run(runtime::SyntaxFunction & function, Stackframe & caller, std::vector<Value> & args) {
+    // Calls into syntax functions don't recurse, they push an activation and carry on in this loop;
+    // only the activations started by this invocation are its to end
+    ActivationsGuard guard { activations.size() };
+
+    std::vector<Value> stack {};
+    stack.reserve(16);
+    std::vector<Handler> handlers {};
+
+    // The running activation, and the parts of it every instruction needs
+    Activation * current;
+    Stackframe * frame;
+    Chunk * chunk;
+    Instruction * code;
+    const exceptions::FilePosition * positions;
+    Value * locals;
+    ENTER(begin(function, caller, args.data(), args.size(), 0, 0));
+
+    size_t ip = 0;
+    Instruction * instr;
+
+#ifdef COMPUTED_GOTO
+    static const void * dispatchTable[] = {
+#define X(name) &&op_##name,
+        BYTECODE_OPCODES(X)
+#undef X
+    };
+#endif
+
+    while (true) {
+        try {
+#ifdef COMPUTED_GOTO
+            DISPATCH();
+#else
+            while (true) {
+                instr = &code[ip];
+                ip++;
+                INSTRUMENT();
+                switch (instr->op) {
+#endif
+            OP(PUSH_CONST) {
+                stack.push_back(chunk->constants[instr->a]);
+            }
+            NEXT;
+            OP(PUSH_COPY) {
+                stack.push_back(chunk->constants[instr->a].deepCopy());
+            }
+            NEXT;
+            OP(PUSH_NULL) {
+                stack.emplace_back();
+            }
+            NEXT;
+            OP(POP) {
+                stack.pop_back();
+            }
+            NEXT;
+            OP(LOAD_LOCAL) {
+                stack.push_back(locals[instr->a]);
+            }
+            NEXT;
+            OP(STORE_LOCAL) {
+                locals[instr->a] = std::move(stack.back());
+                stack.pop_back();
+            }
+            NEXT;
+            OP(LOAD_GLOBAL) {
+                SYNC_POSITION();
+                stack.push_back(*frame->getVariable(chunk->paths[instr->a]));
+            }
+            NEXT;
+            OP(STORE_GLOBAL) {
+                SYNC_POSITION();
+                *frame->getVariable(chunk->paths[instr->a]) = std::move(stack.back());
+                stack.pop_back();
+            }
+            NEXT;
+            OP(INDEX) {
+                SYNC_POSITION();
+                auto result = runtime::indexValue(*frame, stack[stack.size() - 2], stack.back());
+                stack.pop_back();
+                stack.back() = std::move(result);
+            }
+            NEXT;
+            OP(TRY_INDEX) {
+                SYNC_POSITION();
+                Value found;
+                runtime::tryIndex(*frame, stack[stack.size() - 2], stack.back(), found);
+                stack.pop_back();
+                stack.back() = std::move(found);
+            }
+            NEXT;
+            OP(STORE_INDEX) {
+                SYNC_POSITION();
+                const auto size = stack.size();
+                if (!runtime::assignIndex(*frame, stack[size - 3], stack[size - 2], stack[size - 1]))
+                    throw RuntimeError(*frame, *chunk->constants[instr->a].string);
+                stack.resize(size - 3);
+            }
+            NEXT;
+            QUICKENING(ADD, PUNC_PLUS)
+            QUICKENING(SUB, PUNC_MINUS)
+            QUICKENING(MULT, PUNC_MULT)
+            QUICKENING(DIV, PUNC_DIV)
+            QUICKENING(MOD, PUNC_MOD)
+            QUICKENING(EQ, PUNC_DOUBLE_EQ)
+            QUICKENING(NEQ, PUNC_NEQ)
+            QUICKENING(LT, PUNC_LT)
+            QUICKENING(GT, PUNC_GT)
+            QUICKENING(LEQ, PUNC_LEQ)
+            QUICKENING(GEQ, PUNC_GEQ)
+            BINARY(BIT_AND, PUNC_AMPERSAND)
+            BINARY(BIT_OR, PUNC_BITOR)
+            BINARY(XOR, PUNC_XOR)
+            BINARY(SHL, PUNC_SHL)
+            BINARY(SHR, PUNC_SHR)
+            INT_OP(ADD, PUNC_PLUS, true, left.integer + right.integer)
+            INT_OP(SUB, PUNC_MINUS, true, left.integer - right.integer)
+            INT_OP(MULT, PUNC_MULT, true, left.integer * right.integer)
+            INT_OP(DIV, PUNC_DIV, right.integer != 0, left.integer / right.integer)
+            INT_OP(MOD, PUNC_MOD, right.integer != 0, left.integer % right.integer)
+            INT_OP(EQ, PUNC_DOUBLE_EQ, true, left.integer == right.integer)
+            INT_OP(NEQ, PUNC_NEQ, true, left.integer != right.integer)
+            INT_OP(LT, PUNC_LT, true, (double) left.integer < (double) right.integer)
+            INT_OP(GT, PUNC_GT, true, (double) left.integer > (double) right.integer)
+            INT_OP(LEQ, PUNC_LEQ, true, (double) left.integer <= (double) right.integer)
+            INT_OP(GEQ, PUNC_GEQ, true, (double) left.integer >= (double) right.integer)
+            NUM_OP(ADD, PUNC_PLUS, left.number + right.number)
+            NUM_OP(SUB, PUNC_MINUS, left.number - right.number)
+            NUM_OP(MULT, PUNC_MULT, left.number * right.number)
+            NUM_OP(DIV, PUNC_DIV, left.number / right.number)
+            NUM_OP(MOD, PUNC_MOD, std::fmod(left.number, right.number))
+            NUM_OP(EQ, PUNC_DOUBLE_EQ, left.number == right.number)
+            NUM_OP(NEQ, PUNC_NEQ, left.number != right.number)
+            NUM_OP(LT, PUNC_LT, left.number < right.number)
+            NUM_OP(GT, PUNC_GT, left.number > right.number)
+            NUM_OP(LEQ, PUNC_LEQ, left.number <= right.number)
+            NUM_OP(GEQ, PUNC_GEQ, left.number >= right.number)
+            OP(NOT) {
+                stack.back() = Value(!stack.back().asBoolean());
+            }
+            NEXT;
+            OP(TO_BOOL) {
+                stack.back() = Value(stack.back().asBoolean());
+            }
+            NEXT;
+            OP(JUMP) {
+                ip = instr->a;
+            }
+            NEXT;
+            OP(JUMP_IF_FALSE) {
+                auto condition = stack.back().asBoolean();
+                stack.pop_back();
+                if (!condition) ip = instr->a;
+            }
+            NEXT;
+            OP(JUMP_IF_FALSE_OR_POP) {
+                if (!stack.back().asBoolean()) {
+                    stack.back() = Value(false);
+                    ip = instr->a;
+                } else stack.pop_back();
+            }
+            NEXT;
+            OP(JUMP_IF_TRUE_OR_POP) {
+                if (stack.back().asBoolean()) {
+                    stack.back() = Value(true);
+                    ip = instr->a;
+                } else stack.pop_back();
+            }
+            NEXT;
+            OP(CALL) {
+                // Resolved from the call itself, but made from where its arguments left off, like the tree-walker
+                frame->sourcePos = chunk->paths[instr->a].position;
+                auto& fn = frame->root->resolveCall(*frame, chunk->paths[instr->a]);
+                SYNC_POSITION();
+                const auto argsBase = stack.size() - instr->b;
+                if (const auto syntaxFn = fn.asSyntax()) {
+                    current->ip = ip;
+                    auto& callee = begin(*syntaxFn, *frame, stack.data() + argsBase, instr->b, argsBase, handlers.size());
+                    stack.resize(argsBase);
+                    ENTER(callee);
+                    ip = 0;
+                } else {
+                    if constexpr (INSTRUMENTED) if (counters::enabled) counters::native(fn, chunk->paths[instr->a]);
+                    std::vector<Value> callArgs (std::make_move_iterator(stack.begin() + argsBase), std::make_move_iterator(stack.end()));
+                    stack.resize(argsBase);
+                    stack.push_back(fn.call(*frame, callArgs));
+                }
+            }
+            NEXT;
+            OP(TAIL_CALL) {
+                // Resolved from the call itself, but made from where its arguments left off, like the tree-walker
+                frame->sourcePos = chunk->paths[instr->a].position;
+                auto& fn = frame->root->resolveCall(*frame, chunk->paths[instr->a]);
+                SYNC_POSITION();
+                const auto argsBase = stack.size() - instr->b;
+                // Only syntax functions can take over this activation, anything else is just called
+                const auto syntaxFn = fn.asSyntax();
+                if (!syntaxFn) {
+                    if constexpr (INSTRUMENTED) if (counters::enabled) counters::native(fn, chunk->paths[instr->a]);
+                    std::vector<Value> callArgs (std::make_move_iterator(stack.begin() + argsBase), std::make_move_iterator(stack.end()));
+                    stack.resize(argsBase);
+                    stack.push_back(fn.call(*frame, callArgs));
+                    goto returnTop;
+                }
+                if (!syntaxFn->chunk) syntaxFn->chunk = compile(*syntaxFn);
+                // The arguments are on the operand stack, so nothing they hold goes away with the old locals
+                runtime::localStack.release(current->mark);
+                current->chunk = syntaxFn->chunk.get();
+                syntaxFn->enter(*frame, stack.data() + argsBase, instr->b, current->mark);
+                stack.resize(current->stackBase);
+                ENTER(*current);
+                ip = 0;
+            }
+            NEXT;
+            OP(MAKE_LIST) {
+                value::List list (std::make_move_iterator(stack.end() - instr->a), std::make_move_iterator(stack.end()));
+                stack.resize(stack.size() - instr->a);
+                stack.emplace_back(std::move(list));
+            }
+            NEXT;
+            OP(MAKE_MAP) {
+                const auto& keys = chunk->keyLists[instr->a];
+                const auto base = stack.size() - keys.size();
+                value::Map map;
+                map.reserve(keys.size());
+                for (size_t i = 0; i < keys.size(); i++)
+                    map[keys[i]] = std::move(stack[base + i]);
+                stack.resize(base);
+                stack.emplace_back(std::move(map));
+            }
+            NEXT;
+            OP(TRY_BEGIN) {
+                handlers.push_back({ instr->a, stack.size(), activations.size() - 1 });
+            }
+            NEXT;
+            OP(TRY_END) {
+                handlers.pop_back();
+            }
+            NEXT;
+            OP(RETURN) returnTop: {
+                auto result = std::move(stack.back());
+                stack.resize(current->stackBase);
+                handlers.resize(current->handlerBase);
+                activations.pop();
+                if (activations.size() == guard.base) return result;
+                ENTER(activations.top());
+                ip = current->ip;
+                stack.push_back(std::move(result));
+            }
+            NEXT;
+            OP(THROW) {
+                SYNC_POSITION();
+                throw RuntimeError(*frame, *chunk->constants[instr->a].string);
+            }
+#ifndef COMPUTED_GOTO
+                }
+            }
+#endif
+        } catch (RuntimeError & err) {
+            if (handlers.empty()) throw;
+            auto handler = handlers.back();
+            handlers.pop_back();
+            // Any calls the error escaped from are over
+            while (activations.size() > handler.activation + 1)
+                activations.pop();
+            ENTER(activations.top());
+            stack.resize(handler.stackSize);
+            stack.emplace_back(err.message);
+            ip = handler.target;
+        }
+    }
+}
+
+Value bytecode::execute(runtime::SyntaxFunction & function, Stackframe & caller, std::vector<Value> & args) {
+    return profiler::enabled || counters::enabled ? run<true>(function, caller, args) : run<false>(function, caller, args);
+}